@@ -2,6 +2,52 @@
 
 #include <cstdint>
 
+// Rounded 4096 * log2(x / 4096) for x in [4096, 8192), computed bit by bit by repeated squaring in 1.31 fixed point
+static constexpr int FixedLog2(unsigned int x)
+{
+	uint64_t y = (uint64_t)x << 19;
+	uint64_t result = 0;
+	for (int i = 0; i < 30; i++)
+	{
+		y = (y * y) >> 31;
+		result <<= 1;
+		if (y >= (2ull << 31))
+		{
+			y >>= 1;
+			result |= 1;
+		}
+	}
+	return (int)((result + (1 << 17)) >> 18);
+}
+
+static constexpr LogTableData GenerateLogTable()
+{
+	LogTableData table = {};
+	for (int i = TABLE_BIT_PRECISION; i < TABLE_BIT_PRECISION * 2; i++)
+	{
+		table.values[i] = FixedLog2(i);
+	}
+
+	// Below 4096, scale into the range above and subtract whole bits
+	for (int i = 1; i < TABLE_BIT_PRECISION; i++)
+	{
+		int shift = 0;
+		while ((i << shift) < TABLE_BIT_PRECISION)
+			shift++;
+		table.values[i] = table.values[i << shift] - (shift << TABLE_BIT_PRECISION_BITS) + 1;
+	}
+	return table;
+}
+
+// Generated into a constexpr object, so a table that cannot be evaluated at compile time is a build
+// error instead of a dynamic initializer. The exported table is then constant initialized from it.
+static constexpr LogTableData GeneratedLogTable = GenerateLogTable();
+static_assert(GeneratedLogTable.values[1] == -49151, "Log table generated incorrectly");
+static_assert(GeneratedLogTable.values[TABLE_BIT_PRECISION] == 0, "Log table generated incorrectly");
+static_assert(GeneratedLogTable.values[TABLE_BIT_PRECISION * 2 - 1] == 4095, "Log table generated incorrectly");
+
+const LogTableData LogTable = GeneratedLogTable;
+
 void AritCodeInit(struct AritState *state, void *dest_ptr)
 {
 	state->dest_ptr = dest_ptr;
@@ -3,6 +3,7 @@
 #include <memory>
 #include <cstdio>
 #include <vector>
+#include <algorithm>
 #include <xmmintrin.h>
 #include <intrin.h>
 #include <ppl.h>
@@ -14,6 +15,7 @@
 using namespace std;
 
 const int MAX_N_MODELS = 32;
+const int HASH_PREFETCH_DISTANCE = 4;	// Number of bits hash table entries are prefetched ahead of use. Power of 2.
 
 struct Weights;
 void UpdateWeights(Weights *w, int bit, bool saturate);
@@ -98,10 +100,8 @@ void CompressionStream::CompressFromHashBits(const HashBits& hashbits, TinyHashE
 	int bitlength = length / nmodels;
 	assert(bitlength * nmodels == length);
 
+	uint32_t hashshift = HashReductionShift(hashsize);
 	hashsize /= 2;
-	uint32_t hashshift = 0;
-	while (hashsize > (1ull << hashshift))
-		hashshift++;
 	uint32_t rcp_hashsize = (((1ull << (hashshift + 31)) + hashsize - 1) / hashsize);
 	uint32_t rcp_shift = hashshift - 1u + 32u;
 
@@ -109,7 +109,21 @@ void CompressionStream::CompressFromHashBits(const HashBits& hashbits, TinyHashE
 	memset(hashtable, 0, tinyhashsize * sizeof(TinyHashEntry));
 	TinyHashEntry* hashEntries[MAX_N_MODELS];
 
-	int hashpos = 0;
+	// All future hashes are known, so the hashes are reduced and their table entries
+	// prefetched a few bits before they are needed.
+	unsigned int reduced[HASH_PREFETCH_DISTANCE][MAX_N_MODELS];
+	auto prefetch = [&](int bitpos) {
+		const unsigned int* h = &hashbits.hashes[bitpos * nmodels];
+		unsigned int* r = reduced[bitpos & (HASH_PREFETCH_DISTANCE - 1)];
+		for (int m = 0; m < nmodels; m++) {
+			r[m] = h[m] - uint32_t(((uint64_t)h[m] * rcp_hashsize) >> rcp_shift) * hashsize;
+			_mm_prefetch((const char*)&hashtable[r[m] & (tinyhashsize - 1)], _MM_HINT_T0);
+		}
+	};
+	for (int bitpos = 0; bitpos < min(bitlength, HASH_PREFETCH_DISTANCE); bitpos++) {
+		prefetch(bitpos);
+	}
+
 	for (int bitpos = 0; bitpos < bitlength; bitpos++) {
 		int bit = hashbits.bits[bitpos];
 
@@ -119,9 +133,9 @@ void CompressionStream::CompressFromHashBits(const HashBits& hashbits, TinyHashE
 
 		// Query models
 		unsigned int probs[2] = { (unsigned int)baseprob, (unsigned int)baseprob };
+		const unsigned int* r = reduced[bitpos & (HASH_PREFETCH_DISTANCE - 1)];
 		for (int m = 0; m < nmodels; m++) {
-			uint32_t h = hashbits.hashes[hashpos++];
-			unsigned int hash = h - uint32_t(((uint64_t)h * rcp_hashsize) >> rcp_shift) * hashsize;
+			unsigned int hash = r[m];
 
 			unsigned int tinyHash = hash & (tinyhashsize - 1);
 			TinyHashEntry *he = &hashtable[tinyHash];
@@ -148,8 +162,9 @@ void CompressionStream::CompressFromHashBits(const HashBits& hashbits, TinyHashE
 					he = &hashtable[tinyHash];
 				}
 			}
-			
-			
+		}
+		if (bitpos + HASH_PREFETCH_DISTANCE < bitlength) {
+			prefetch(bitpos + HASH_PREFETCH_DISTANCE);
 		}
 
 		// Encode bit
@@ -166,6 +181,151 @@ void CompressionStream::CompressFromHashBits(const HashBits& hashbits, TinyHashE
 	}
 }
 
+int CompressionStream::HashReductionShift(int hashsize) {
+	hashsize /= 2;
+	int hashshift = 0;
+	while (hashsize > (1ll << hashshift))
+		hashshift++;
+	return hashshift;
+}
+
+void CompressionStream::CompressFromHashBitsBatch(CompressionStream** streams, int numStreams, const HashBits& hashbits, TinyHashEntry** hashtables, int baseprob, const int* hashsizes, const std::atomic<int>* sizeLimit, bool* aborted) {
+	assert(numStreams > 0 && numStreams <= MAX_HASHSIZE_BATCH);
+	int length = (int)hashbits.hashes.size();
+	int nmodels = (int)hashbits.weights.size();
+	int bitlength = length / nmodels;
+	assert(bitlength * nmodels == length);
+
+	// Per-lane reduction constants. Unused lanes repeat the first hash size.
+	uint32_t hashshift = HashReductionShift(hashsizes[0]);
+	uint32_t lane_hashsize[4];
+	uint32_t lane_rcp[4];
+	for (int i = 0; i < 4; i++) {
+		int hashsize = hashsizes[i < numStreams ? i : 0];
+		assert(HashReductionShift(hashsize) == (int)hashshift);
+		hashsize /= 2;
+		lane_hashsize[i] = hashsize;
+		lane_rcp[i] = (uint32_t)(((1ull << (hashshift + 31)) + hashsize - 1) / hashsize);
+	}
+	__m128i vhashsize = _mm_loadu_si128((__m128i*)lane_hashsize);
+	__m128i vhashsize_odd = _mm_srli_epi64(vhashsize, 32);
+	__m128i vrcp = _mm_loadu_si128((__m128i*)lane_rcp);
+	__m128i vrcp_odd = _mm_srli_epi64(vrcp, 32);
+	__m128i vhighmask = _mm_set_epi32(-1, 0, -1, 0);
+	__m128i vshift = _mm_cvtsi32_si128(hashshift - 1);
+
+	unsigned int tinyhashsize = hashbits.tinyhashsize;
+	for (int i = 0; i < numStreams; i++) {
+		memset(hashtables[i], 0, tinyhashsize * sizeof(TinyHashEntry));
+	}
+	TinyHashEntry* hashEntries[MAX_HASHSIZE_BATCH][MAX_N_MODELS];
+	bool saturate = streams[0]->m_saturate;
+
+	int numActive = 0;
+	for (int i = 0; i < numStreams; i++) {
+		numActive += !aborted[i];
+	}
+
+	// Reduce the hashes for all hash sizes at once and prefetch the table entries
+	// a few bits ahead: h - ((h * rcp) >> (32 + shift - 1)) * hashsize
+	uint32_t reduced[HASH_PREFETCH_DISTANCE][MAX_N_MODELS][4];
+	auto prefetch = [&](int bitpos) {
+		const unsigned int* h = &hashbits.hashes[bitpos * nmodels];
+		uint32_t (*r)[4] = reduced[bitpos & (HASH_PREFETCH_DISTANCE - 1)];
+		for (int m = 0; m < nmodels; m++) {
+			__m128i vh = _mm_set1_epi32(h[m]);
+			__m128i vq = _mm_or_si128(
+				_mm_srli_epi64(_mm_mul_epu32(vh, vrcp), 32),
+				_mm_and_si128(_mm_mul_epu32(vh, vrcp_odd), vhighmask));
+			vq = _mm_srl_epi32(vq, vshift);
+			__m128i vqs_even = _mm_mul_epu32(vq, vhashsize);
+			__m128i vqs_odd = _mm_mul_epu32(_mm_srli_epi64(vq, 32), vhashsize_odd);
+			__m128i vqs = _mm_unpacklo_epi32(_mm_shuffle_epi32(vqs_even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(vqs_odd, _MM_SHUFFLE(0, 0, 2, 0)));
+			_mm_storeu_si128((__m128i*)r[m], _mm_sub_epi32(vh, vqs));
+
+			for (int i = 0; i < numStreams; i++) {
+				if (!aborted[i])
+					_mm_prefetch((const char*)&hashtables[i][r[m][i] & (tinyhashsize - 1)], _MM_HINT_T0);
+			}
+		}
+	};
+	for (int bitpos = 0; bitpos < min(bitlength, HASH_PREFETCH_DISTANCE); bitpos++) {
+		prefetch(bitpos);
+	}
+
+	for (int bitpos = 0; bitpos < bitlength && numActive > 0; bitpos++) {
+		int bit = hashbits.bits[bitpos];
+
+		// The output never shrinks, so a stream that has already emitted more bytes
+		// than the best known result can not win.
+		if (sizeLimit && (bitpos & 7) == 0) {
+			int limit = sizeLimit->load(std::memory_order_relaxed);
+			for (int i = 0; i < numStreams; i++) {
+				if (!aborted[i] && ((int)streams[i]->m_aritstate.dest_bit + 7) / 8 > limit) {
+					aborted[i] = true;
+					numActive--;
+				}
+			}
+		}
+
+		// Query models
+		unsigned int probs[MAX_HASHSIZE_BATCH][2];
+		for (int i = 0; i < numStreams; i++) {
+			probs[i][0] = probs[i][1] = baseprob;
+		}
+		uint32_t (*r)[4] = reduced[bitpos & (HASH_PREFETCH_DISTANCE - 1)];
+		for (int m = 0; m < nmodels; m++) {
+			int fac = hashbits.weights[m];
+			for (int i = 0; i < numStreams; i++) {
+				if (aborted[i])
+					continue;
+				unsigned int hash = r[m][i];
+				unsigned int tinyHash = hash & (tinyhashsize - 1);
+				TinyHashEntry* hashtable = hashtables[i];
+				TinyHashEntry* he = &hashtable[tinyHash];
+
+				while (true)
+				{
+					if (he->used == 0) {
+						he->hash = hash;
+						he->used = 1;
+						hashEntries[i][m] = he;
+						break;
+					} else if (he->hash == hash) {
+						hashEntries[i][m] = he;
+
+						unsigned int shift = (1 - (((he->prob[0] + 255)&(he->prob[1] + 255)) >> 8)) * 2 + fac;
+						probs[i][0] += ((unsigned int)he->prob[0] << shift);
+						probs[i][1] += ((unsigned int)he->prob[1] << shift);
+						break;
+					} else {
+						tinyHash++;
+						if (tinyHash >= tinyhashsize)
+							tinyHash = 0;
+						he = &hashtable[tinyHash];
+					}
+				}
+			}
+		}
+		if (bitpos + HASH_PREFETCH_DISTANCE < bitlength) {
+			prefetch(bitpos + HASH_PREFETCH_DISTANCE);
+		}
+
+		for (int i = 0; i < numStreams; i++) {
+			if (aborted[i])
+				continue;
+
+			// Encode bit
+			AritCode(&streams[i]->m_aritstate, probs[i][1], probs[i][0], 1 - bit);
+
+			// Update models
+			for (int m = 0; m < nmodels; m++) {
+				UpdateWeights((Weights*)hashEntries[i][m]->prob, bit, saturate);
+			}
+		}
+	}
+}
+
 __forceinline uint32_t Hash(__m128i& masked_contextdata)
 {
 	__m128i scrambler = _mm_set_epi8(113, 23, 5, 17, 13, 11, 7, 19, 3, 23, 29, 31, 37, 41, 43, 47);
@@ -178,7 +338,7 @@ __forceinline uint32_t Hash(__m128i& masked_contextdata)
 	return (uint32_t)tmp ^ uint32_t(tmp >> 32);
 }
 
-int CompressionStream::EvaluateSize(const unsigned char* d, int size, const ModelList4k& models, int baseprob, char* context, int bitpos) {
+int CompressionStream::EvaluateSize(const unsigned char* d, int size, const ModelList4k& models, int baseprob, char* context, int bitpos, int* outCosts) {
 	unsigned char* data = new unsigned char[size + MAX_CONTEXT_LENGTH + 16];	// Ensure 128bit operations are safe
 	memcpy(data, context, MAX_CONTEXT_LENGTH);
 	data += MAX_CONTEXT_LENGTH;
@@ -195,7 +355,7 @@ int CompressionStream::EvaluateSize(const unsigned char* d, int size, const Mode
 		sums[i*2] = baseprob;
 		sums[i*2+1] = baseprob;
 	}
-	CounterState* counter_states_ptr = m_saturate ? saturated_counter_states : unsaturated_counter_states;
+	const CounterState* counter_states_ptr = m_saturate ? saturated_counter_states.states : unsaturated_counter_states.states;
 
 	// Clear hashtable
 	memset(hash_positions, -1, tinyhashsize * sizeof(hash_positions[0]));
@@ -245,7 +405,7 @@ int CompressionStream::EvaluateSize(const unsigned char* d, int size, const Mode
 				
 				if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128((__m128i *)&data[candidate_pos - MAX_CONTEXT_LENGTH]), mask), masked_contextdata)) == 0xFFFF)
 				{
-					CounterState& state = counter_states_ptr[hash_counter_states[tinyhash]];
+					const CounterState& state = counter_states_ptr[hash_counter_states[tinyhash]];
 					__m128i vsum = _mm_loadl_epi64((__m128i*)&sums[pos * 2]);
 					vsum = _mm_add_epi32(vsum, _mm_sll_epi32(_mm_unpacklo_epi16(_mm_loadl_epi64((__m128i*)state.boosted_counters), vzero), vweight));
 					_mm_storel_epi64((__m128i*)&sums[pos * 2], vsum);
@@ -262,7 +422,10 @@ int CompressionStream::EvaluateSize(const unsigned char* d, int size, const Mode
 	uint64_t totalsize = 0;
 	for(int pos = 0; pos < size; pos++) {
 		int bit = (data[pos] >> inverted_bitpos) & 1;
-		totalsize += AritSize2(sums[pos * 2 + bit], sums[pos * 2 + !bit]);
+		int bitsize = AritSize2(sums[pos * 2 + bit], sums[pos * 2 + !bit]);
+		totalsize += bitsize;
+		if(outCosts)
+			outCosts[pos] = bitsize / (TABLE_BIT_PRECISION / BIT_PRECISION);
 	}
 	
 	delete[] hash_positions;
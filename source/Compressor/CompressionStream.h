@@ -3,6 +3,7 @@
 #define _COMPRESSION_STREAM_H_
 
 #include <vector>
+#include <atomic>
 
 #include "aritcode.h"
 #include "ModelList.h"
@@ -14,6 +15,8 @@ struct HashBits {
 	unsigned int			tinyhashsize;
 };
 
+static const int MAX_HASHSIZE_BATCH = 4;	// Number of hash sizes simulated together by CompressFromHashBitsBatch
+
 struct TinyHashEntry {
 	unsigned int	hash;
 	unsigned char	prob[2];
@@ -31,8 +34,16 @@ public:
 	CompressionStream(unsigned char* data, int* sizefill, int maxsize, bool saturate);
 	
 	void	CompressFromHashBits(const HashBits& hashbits, TinyHashEntry* hashtable, int baseprob, int hashsize);
-	int		EvaluateSize(const unsigned char* data, int size, const ModelList4k& models, int baseprob, char* context, int bitpos);
+	// If outCosts is given, it receives the ideal coded size of the bit at each position (in BIT_PRECISION units).
+	int		EvaluateSize(const unsigned char* data, int size, const ModelList4k& models, int baseprob, char* context, int bitpos, int* outCosts);
 	int		Close();
+
+	// Compress the same hash bits into several streams at once, each with its own hash table and hash size.
+	// All hash sizes must reduce with the same shift (see HashReductionShift).
+	// If sizeLimit is given, a stream is abandoned (and flagged in aborted) as soon as its
+	// output is certain to end up larger than *sizeLimit bytes.
+	static void	CompressFromHashBitsBatch(CompressionStream** streams, int numStreams, const HashBits& hashbits, TinyHashEntry** hashtables, int baseprob, const int* hashsizes, const std::atomic<int>* sizeLimit, bool* aborted);
+	static int	HashReductionShift(int hashsize);
 };
 
 HashBits ComputeHashBits(const unsigned char* d, int size, unsigned char* context, const ModelList4k& models, bool first, bool finish);
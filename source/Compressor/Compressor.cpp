@@ -1,6 +1,8 @@
 #include <windows.h>
 #include <cstdio>
 #include <ppl.h>
+#include <algorithm>
+#include <climits>
 #include "Compressor.h"
 #include "CompressionState.h"
 #include "CompressionStateEvaluator.h"
@@ -256,6 +258,22 @@ ModelList4k ApproximateModels4k(const unsigned char* data, int datasize, const u
 	return models;
 }
 
+// Context of one bit under one 1k model. Contexts are equal exactly when the bit position,
+// the known bits of the current byte and the bytes selected by the model are equal.
+struct SContext1k
+{
+	uint64_t prev;		// Bytes selected by the model, byte k-1 holding data[bytepos - k]
+	unsigned int cur;	// bitpos << 8 | known bits of current byte
+	int pos;			// Bit index, bytepos * 8 + bitpos
+
+	bool operator<(const SContext1k& other) const
+	{
+		if (cur != other.cur) return cur < other.cur;
+		if (prev != other.prev) return prev < other.prev;
+		return pos < other.pos;
+	}
+};
+
 static int* GenerateModelData1k(const unsigned char* org_data, int datasize)
 {
 	unsigned char* data = new unsigned char[datasize + 16];
@@ -266,135 +284,79 @@ static int* GenerateModelData1k(const unsigned char* org_data, int datasize)
 	int bitlength = datasize * 8;
 	int* modeldata = new int[bitlength*NUM_1K_MODELS * 2];
 
-	// Collect model data
-	struct SHashEntry
-	{
-		unsigned int hash;
-		int c[2];
-		unsigned char model;
-		unsigned char bitpos;
-		short bytepos;
-		
-	};
-	const int hash_table_size = bitlength*NUM_1K_MODELS * 2;
-	SHashEntry* hash_table = new SHashEntry[hash_table_size];
-	for (int i = 0; i < hash_table_size; i++)
+	// Collect model data. Sorting the contexts of a model groups identical contexts together,
+	// in the order they occur, so the counters can be replayed group by group.
+	int numContexts = (datasize + 1) * 8;
+	concurrency::combinable<std::vector<SContext1k>> context_buffers([numContexts]() { return std::vector<SContext1k>(numContexts); });
+	concurrency::parallel_for(0, NUM_1K_MODELS, [&](int model_idx)
 	{
-		SHashEntry& entry = hash_table[i];
-		entry.model = 0;
-		entry.bitpos = 0;
-		entry.bytepos = 0x7FFF;
-		entry.c[0] = 0;
-		entry.c[1] = 0;
-	}
+		int model = (unsigned char)(model_idx - 1);
+		std::vector<SContext1k>& contexts = context_buffers.local();
 
-	for(int bytepos = -1; bytepos < datasize; bytepos++)
-	{
-		for(int bitpos = 0; bitpos < 8; bitpos++)
+		for(int bytepos = -1; bytepos < datasize; bytepos++)
 		{
-
-			int mask = 0xFF00 >> bitpos;
-			int bit = ((data[bytepos] << bitpos) & 0x80) == 0x80;
-
-			for(int model_idx = 0; model_idx < NUM_1K_MODELS; model_idx++)
+			uint64_t prev = 0;
+			for(int k = 1; k <= 8; k++)
 			{
-				int model = (unsigned char)(model_idx - 1);
-				// Calculate hash
-				unsigned int hash = bitpos + (data[bytepos] & mask) * 8;
-				int m = model;
-				int k = 1;
-				while(m)
+				if(model & (1 << (k - 1)))
 				{
-					hash = hash * 237 + 4123;
-					if(m & 1)
-					{
-						hash += data[bytepos - k];
-					}
-
-					k++;
-					m >>= 1;
+					prev |= (uint64_t)data[bytepos - k] << ((k - 1) * 8);
 				}
+			}
 
-				unsigned int entry_idx = hash % hash_table_size;
-				SHashEntry* entry_ptr = NULL;
-				while(true)
-				{
-					entry_ptr = &hash_table[entry_idx];
-					if(entry_ptr->bytepos == 0x7FFF)
-					{
-						entry_ptr->hash = hash;
-						entry_ptr->model = model;
-						entry_ptr->bitpos = bitpos;
-						entry_ptr->bytepos = bytepos;
-						entry_ptr->c[0] = 0;
-						entry_ptr->c[1] = 0;
-						break;
-					}
-					else
-					{
-						bool match = false;
+			for(int bitpos = 0; bitpos < 8; bitpos++)
+			{
+				int mask = 0xFF00 >> bitpos;
+				SContext1k& context = contexts[(bytepos + 1) * 8 + bitpos];
+				context.prev = prev;
+				context.cur = (bitpos << 8) | (data[bytepos] & mask);
+				context.pos = bytepos * 8 + bitpos;
+			}
+		}
 
-						// Does it match?
-						if(entry_ptr->hash == hash && entry_ptr->bitpos == bitpos && entry_ptr->model == model && (data[entry_ptr->bytepos] & mask) == (data[bytepos] & mask))
-						{
-							match = true;
-
-							int m = model;
-							int k = 1;
-							while(m)
-							{
-								if(m & 1)
-								{
-									if(data[entry_ptr->bytepos - k] != data[bytepos - k])
-									{
-										match = false;
-										break;
-									}
-								}
-								k++;
-								m >>= 1;
-							}
-						}
+		std::sort(contexts.begin(), contexts.end());
 
-						if(match)
-						{
-							break;
-						}
-						else
-						{
-							entry_idx++;
-							if(entry_idx >= (unsigned int)hash_table_size) entry_idx = 0;
-						}
-					}
-				}
+		int c[2] = {};
+		for(int i = 0; i < numContexts; i++)
+		{
+			const SContext1k& context = contexts[i];
+			if(i > 0 && (context.cur != contexts[i - 1].cur || context.prev != contexts[i - 1].prev))
+			{
+				c[0] = 0;
+				c[1] = 0;
+			}
 
-				if(bytepos >= 0)
-				{
-					int i = bytepos * 8 + bitpos;
-					modeldata[(bitlength*model_idx + i) * 2] = entry_ptr->c[bit];
-					modeldata[(bitlength*model_idx + i) * 2 + 1] = entry_ptr->c[1 - bit];
-				}
-				
-				entry_ptr->c[bit]++;
-				entry_ptr->c[!bit] = (entry_ptr->c[!bit] + 1) / 2;
+			int bit = ((data[context.pos >> 3] << (context.pos & 7)) & 0x80) == 0x80;
+			if(context.pos >= 0)
+			{
+				modeldata[(bitlength*model_idx + context.pos) * 2] = c[bit];
+				modeldata[(bitlength*model_idx + context.pos) * 2 + 1] = c[1 - bit];
 			}
+
+			c[bit]++;
+			c[!bit] = (c[!bit] + 1) / 2;
 		}
+	});
 
-	}
-	
-	delete[] hash_table;
-	
 	data -= 16;
 	delete[] data;
 
 	return modeldata;
 }
 
+// Context for a segment is the data preceding it, padded with zeros
+static void GetSegmentContext(const unsigned char* inputData, int offset, char* context)
+{
+	for (int i = 0; i < MAX_CONTEXT_LENGTH; i++)
+	{
+		int srcpos = offset - MAX_CONTEXT_LENGTH + i;
+		context[i] = srcpos >= 0 ? inputData[srcpos] : 0;
+	}
+}
+
 int	EvaluateSize4k(const unsigned char* inputData, int numSegments, const int* segmentSizes, int* outCompressedSegmentSizes, ModelList4k** modelLists, int baseprob, bool saturate)
 {
-	CompressionStream cs(NULL, NULL, 0, saturate);
-	
-	std::vector<int> compressedSizes(numSegments * 8);
+	std::vector<int> compressedSizes(numSegments);
 	std::vector<int> segmentOffsets(numSegments);
 	
 	int segmentOffset = 0;
@@ -404,37 +366,55 @@ int	EvaluateSize4k(const unsigned char* inputData, int numSegments, const int* s
 		segmentOffset += segmentSizes[i];
 	}
 
-	concurrency::parallel_for(0, numSegments * 8, [&](int i)
+	concurrency::parallel_for(0, numSegments, [&](int i)
 	{
-		int segment = i >> 3;
-		int bitpos = i & 7;
-
-		int offset = segmentOffsets[segment];
-		char context[MAX_CONTEXT_LENGTH];
-		for (int i = 0; i < MAX_CONTEXT_LENGTH; i++)
-		{
-			int srcpos = offset - MAX_CONTEXT_LENGTH + i;
-			context[i] = srcpos >= 0 ? inputData[srcpos] : 0;
-		}
-
-		compressedSizes[i] = cs.EvaluateSize(inputData + offset, segmentSizes[segment], *modelLists[segment], baseprob, context, bitpos);
+		compressedSizes[i] = EvaluateSegmentSize4k(inputData, segmentOffsets[i], segmentSizes[i], *modelLists[i], baseprob, saturate, nullptr);
 	});
 
 	int totalSize = 0;
 	for (int i = 0; i < numSegments; i++)
 	{
-		int segmentSize = modelLists[i]->nmodels * 8 * BIT_PRECISION;
-		for (int j = 0; j < 8; j++)
-			segmentSize += compressedSizes[i * 8 + j];
-		totalSize += segmentSize;
+		totalSize += compressedSizes[i];
 		
 		if (outCompressedSegmentSizes)
-			outCompressedSegmentSizes[i] = segmentSize;
+			outCompressedSegmentSizes[i] = compressedSizes[i];
 	}
 	
 	return totalSize;
 }
 
+int EvaluateSegmentSize4k(const unsigned char* inputData, int segmentOffset, int segmentSize, ModelList4k& modelList, int baseprob, bool saturate, int* outByteCosts)
+{
+	CompressionStream cs(NULL, NULL, 0, saturate);
+
+	std::vector<int> bitCosts(outByteCosts ? segmentSize * 8 : 0);
+	int compressedSizes[8];
+	concurrency::parallel_for(0, 8, [&](int bitpos)
+	{
+		char context[MAX_CONTEXT_LENGTH];
+		GetSegmentContext(inputData, segmentOffset, context);
+
+		int* costs = outByteCosts ? &bitCosts[bitpos * segmentSize] : nullptr;
+		compressedSizes[bitpos] = cs.EvaluateSize(inputData + segmentOffset, segmentSize, modelList, baseprob, context, bitpos, costs);
+	});
+
+	if (outByteCosts)
+	{
+		for (int pos = 0; pos < segmentSize; pos++)
+		{
+			int cost = 0;
+			for (int bitpos = 0; bitpos < 8; bitpos++)
+				cost += bitCosts[bitpos * segmentSize + pos];
+			outByteCosts[pos] = cost;
+		}
+	}
+
+	int compressedSize = modelList.nmodels * 8 * BIT_PRECISION;
+	for (int j = 0; j < 8; j++)
+		compressedSize += compressedSizes[j];
+	return compressedSize;
+}
+
 int Compress4k(const unsigned char* inputData, int numSegments, const int* segmentSizes, unsigned char* outCompressedData, int maxCompressedSize, ModelList4k** modelLists, bool saturate, int baseprob, int hashsize, int* sizefill)
 {
 	unsigned char context[MAX_CONTEXT_LENGTH] = {};
@@ -467,132 +447,298 @@ int CompressFromHashBits4k(const HashBits* hashbits, TinyHashEntry** hashtables,
 	return cs.Close();
 }
 
-int Compress1k(const unsigned char* orgInputData, int inputSize, unsigned char* outCompressedData, int maxCompressedSize, ModelList1k& modelList, int* sizefill, int* outInternalSize)
+// Compress the hash bits with several hash sizes in one pass. Each hash size uses its own
+// hash table (large enough for every segment) and output buffer.
+// Hash sizes whose result is known to exceed *sizeLimit are abandoned and get size INT_MAX.
+void CompressFromHashBitsBatch4k(const HashBits* hashbits, TinyHashEntry** hashtables, int numSegments, unsigned char** outCompressedData, int maxCompressedSize, bool saturate, int baseprob, const int* hashsizes, int numHashsizes, int* outCompressedSizes, const std::atomic<int>* sizeLimit)
 {
-	int boost_factor = modelList.boost;
-	int b0 = modelList.baseprob0;
-	int b1 = modelList.baseprob1;
-	unsigned int modelmask = modelList.modelmask;
+	for (int first = 0; first < numHashsizes;)
+	{
+		// Hash sizes simulated together must share the reduction shift
+		int count = 1;
+		int hashshift = CompressionStream::HashReductionShift(hashsizes[first]);
+		while (first + count < numHashsizes && count < MAX_HASHSIZE_BATCH && CompressionStream::HashReductionShift(hashsizes[first + count]) == hashshift)
+			count++;
+
+		CompressionStream* streams[MAX_HASHSIZE_BATCH];
+		bool aborted[MAX_HASHSIZE_BATCH];
+		for (int i = 0; i < count; i++)
+		{
+			streams[i] = new CompressionStream(outCompressedData[first + i], nullptr, maxCompressedSize, saturate);
+			aborted[i] = false;
+		}
+		for (int s = 0; s < numSegments; s++)
+		{
+			CompressionStream::CompressFromHashBitsBatch(streams, count, hashbits[s], &hashtables[first], baseprob, &hashsizes[first], sizeLimit, aborted);
+		}
+		for (int i = 0; i < count; i++)
+		{
+			outCompressedSizes[first + i] = aborted[i] ? INT_MAX : streams[i]->Close();
+			delete streams[i];
+		}
+		first += count;
+	}
+}
 
-	unsigned char* data = new unsigned char[inputSize + 32];
-	memset(data, 0, 32);
-	data += 32;
-	memcpy(data, orgInputData, inputSize);
+// Predict the damage done by each hash size without compressing: for every slot shared by
+// several distinct contexts, count the occurrences of all but the most frequent context.
+void PredictHashCollisions4k(const HashBits* hashbits, int numSegments, const int* hashsizes, int numHashsizes, long long* outCollisions)
+{
+	// Distinct contexts of each segment along with their occurrence counts
+	std::vector<std::vector<unsigned int>> contexts(numSegments);
+	std::vector<std::vector<unsigned int>> counts(numSegments);
+	for (int s = 0; s < numSegments; s++)
+	{
+		std::vector<unsigned int> hashes(hashbits[s].hashes);
+		std::sort(hashes.begin(), hashes.end());
+		for (size_t i = 0; i < hashes.size(); i++)
+		{
+			if (i > 0 && hashes[i] == hashes[i - 1])
+			{
+				counts[s].back()++;
+			}
+			else
+			{
+				contexts[s].push_back(hashes[i]);
+				counts[s].push_back(1);
+			}
+		}
+	}
 
-	struct SHashEntry1	// Hash table is split in hot/cold
+	std::vector<long long> taskCollisions(numHashsizes * numSegments);
+	concurrency::parallel_for(0, numHashsizes * numSegments, [&](int task)
 	{
-		unsigned int hash;
-		int bytepos;
-		unsigned int c[2];
-	};
+		int i = task / numSegments;
+		int s = task % numSegments;
+
+		// Same reduction as CompressionStream::CompressFromHashBits
+		uint32_t hashshift = CompressionStream::HashReductionShift(hashsizes[i]);
+		uint32_t hashsize = hashsizes[i] / 2;
+		uint32_t rcp_hashsize = (((1ull << (hashshift + 31)) + hashsize - 1) / hashsize);
+		uint32_t rcp_shift = hashshift - 1u + 32u;
+
+		// Slot in the high half, occurrence count in the low half
+		const std::vector<unsigned int>& segmentContexts = contexts[s];
+		std::vector<uint64_t> slots(segmentContexts.size());
+		for (size_t c = 0; c < segmentContexts.size(); c++)
+		{
+			uint32_t h = segmentContexts[c];
+			uint32_t hash = h - uint32_t(((uint64_t)h * rcp_hashsize) >> rcp_shift) * hashsize;
+			slots[c] = ((uint64_t)hash << 32) | counts[s][c];
+		}
+		std::sort(slots.begin(), slots.end());
 
-	struct SEncodeEntry
+		long long collisions = 0;
+		for (size_t c = 0; c < slots.size();)
+		{
+			size_t end = c + 1;
+			unsigned int total = (unsigned int)slots[c];
+			unsigned int largest = total;
+			while (end < slots.size() && (slots[end] >> 32) == (slots[c] >> 32))
+			{
+				unsigned int count = (unsigned int)slots[end++];
+				total += count;
+				if (count > largest)
+					largest = count;
+			}
+			collisions += total - largest;
+			c = end;
+		}
+		taskCollisions[task] = collisions;
+	});
+
+	for (int i = 0; i < numHashsizes; i++)
 	{
-		unsigned int n[2];
-	};
-	SEncodeEntry* encode_entries = new SEncodeEntry[8 * inputSize];
-	memset(encode_entries, 0, 8 * inputSize * sizeof(SEncodeEntry));
+		outCollisions[i] = 0;
+		for (int s = 0; s < numSegments; s++)
+		{
+			outCollisions[i] += taskCollisions[i * numSegments + s];
+		}
+	}
+}
+
+struct SHashEntry1	// Hash table is split in hot/cold
+{
+	unsigned int hash;
+	int bytepos;
+	unsigned int c[2];
+};
+
+struct SEncodeEntry
+{
+	unsigned int n[2];
+};
+
+// Sum the boosted counts of all enabled models into encode_entries (8 * inputSize entries, bitpos major).
+// Every (bitpos, model) pair is a separate task. Tasks accumulate into per-thread copies of the
+// entries, which are added together at the end, so the result does not depend on scheduling.
+static void Compute1kEncodeEntries(const unsigned char* data, int inputSize, unsigned int modelmask, int boost_factor, SEncodeEntry* encode_entries)
+{
+	int models[NUM_1K_MODELS];
+	int num_models = 0;
+	for (int model_idx = 0; model_idx < NUM_1K_MODELS; model_idx++)
+	{
+		if (model_idx == 32 || (modelmask & (1 << model_idx)) != 0)
+			models[num_models++] = model_idx;
+	}
 
 	const int hash_table_size = NextPowerOf2(inputSize * 2);
 
-	SHashEntry1* hash_table_data = new SHashEntry1[hash_table_size * 8];
-	
-	concurrency::parallel_for(0, 8, [&](int bitpos)
+	// One hash table per thread, cleared for each task
+	concurrency::combinable<std::vector<SHashEntry1>> hash_tables([hash_table_size]() { return std::vector<SHashEntry1>(hash_table_size); });
+	concurrency::combinable<std::vector<SEncodeEntry>> local_entries([inputSize]() { return std::vector<SEncodeEntry>(8 * inputSize, SEncodeEntry{}); });
+
+	concurrency::parallel_for(0, 8 * num_models, [&](int task)
 	{
+		int bitpos = task % 8;
+		int model_idx = models[task / 8];
 		int mask = 0xFF00 >> bitpos;
-		SHashEntry1* hash_table1 = &hash_table_data[bitpos * hash_table_size];
+		SHashEntry1* hash_table = hash_tables.local().data();
+		SEncodeEntry* thread_entries = local_entries.local().data();
 
 		__m128i zero = _mm_setzero_si128();
 
-		for (int model_idx = 0; model_idx < NUM_1K_MODELS; model_idx++)
-		{
-			if (model_idx != 32 && (modelmask & (1 << model_idx)) == 0)
-				continue;
+		memset(hash_table, 0, hash_table_size * sizeof(SHashEntry1));
 
-			memset(hash_table1, 0, hash_table_size * sizeof(SHashEntry1));
-		
-			int model = (unsigned char)(model_idx - 1);
-			int rev_model = ReverseByte(model) << 8;
+		int model = (unsigned char)(model_idx - 1);
+		int rev_model = ReverseByte(model) << 8;
 
-			__m128i mulmask;
+		__m128i mulmask;
+		{
+			unsigned short words[8] = {0x2aec, 0xa92a, 0xb64f, 0xbf7a, 0xc57c, 0x0d27, 0x2918, 0x9772 };
+			for(int i = 0; i < 8; i++)
 			{
-				unsigned short words[8] = {0x2aec, 0xa92a, 0xb64f, 0xbf7a, 0xc57c, 0x0d27, 0x2918, 0x9772 };
-				for(int i = 0; i < 8; i++)
+				if((rev_model & (1 << (i + 8))) == 0)
 				{
-					if((rev_model & (1 << (i + 8))) == 0)
-					{
-						words[i] = 0;
-					}
+					words[i] = 0;
 				}
-				mulmask = _mm_loadu_si128((__m128i*)words);
 			}
+			mulmask = _mm_loadu_si128((__m128i*)words);
+		}
+		
+
+		for (int bytepos = -1; bytepos < inputSize; bytepos++)
+		{
+			int bit = ((data[bytepos] << bitpos) & 0x80) == 0x80;
+
+			unsigned int mmask = model;
+
+			// Calculate hash
+			__m128i context_data = _mm_loadu_si128((__m128i*)&data[bytepos-16]);
+			context_data = _mm_unpackhi_epi8(context_data, zero);
+			__m128i temp_sum = _mm_mullo_epi16(context_data, mulmask);
+			temp_sum = _mm_add_epi16(temp_sum, _mm_srli_si128(temp_sum, 8));
+			temp_sum= _mm_add_epi16(temp_sum, _mm_srli_si128(temp_sum, 4));
+			temp_sum= _mm_add_epi16(temp_sum, _mm_srli_si128(temp_sum, 2));
+			unsigned int hash = _mm_cvtsi128_si32(temp_sum) + (data[bytepos] & mask) * 4112361;
+			if(hash == 0) hash = 1;
 			
+			unsigned int entry_idx = hash & (hash_table_size - 1);
 
-			for (int bytepos = -1; bytepos < inputSize; bytepos++)
+			while (true)
 			{
-				int bit = ((data[bytepos] << bitpos) & 0x80) == 0x80;
-
-				unsigned int mmask = model;
-
-				// Calculate hash
-				__m128i context_data = _mm_loadu_si128((__m128i*)&data[bytepos-16]);
-				context_data = _mm_unpackhi_epi8(context_data, zero);
-				__m128i temp_sum = _mm_mullo_epi16(context_data, mulmask);
-				temp_sum = _mm_add_epi16(temp_sum, _mm_srli_si128(temp_sum, 8));
-				temp_sum= _mm_add_epi16(temp_sum, _mm_srli_si128(temp_sum, 4));
-				temp_sum= _mm_add_epi16(temp_sum, _mm_srli_si128(temp_sum, 2));
-				unsigned int hash = _mm_cvtsi128_si32(temp_sum) + (data[bytepos] & mask) * 4112361;
-				if(hash == 0) hash = 1;
-				
-				unsigned int entry_idx = hash & (hash_table_size - 1);
-
-				while (true)
+				SHashEntry1* entry_ptr = &hash_table[entry_idx];
+				if(entry_ptr->hash == 0)
+				{	
+					entry_ptr->hash = hash;
+					entry_ptr->bytepos = bytepos;
+					entry_ptr->c[bit] = 1;
+					entry_ptr->c[1 - bit] = 0;
+					break;
+				}
+				else
 				{
-					SHashEntry1* entry_ptr = &hash_table1[entry_idx];
-					if(entry_ptr->hash == 0)
-					{	
-						entry_ptr->hash = hash;
-						entry_ptr->bytepos = bytepos;
-						entry_ptr->c[bit] = 1;
-						entry_ptr->c[1 - bit] = 0;
-						break;
-					}
-					else
+					assert(bytepos >= 0);	// bytepos == -1 should always hit empty bucket case
+					if(entry_ptr->hash == hash && (data[entry_ptr->bytepos] & mask) == (data[bytepos] & mask))
 					{
-						assert(bytepos >= 0);	// bytepos == -1 should always hit empty bucket case
-						if(entry_ptr->hash == hash && (data[entry_ptr->bytepos] & mask) == (data[bytepos] & mask))
+						__m128i a = _mm_loadu_si128((__m128i*)&data[entry_ptr->bytepos - 16]);
+						__m128i b = _mm_loadu_si128((__m128i*)&data[bytepos - 16]);
+						int match_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+						if((match_mask & rev_model) == rev_model)
 						{
-							__m128i a = _mm_loadu_si128((__m128i*)&data[entry_ptr->bytepos - 16]);
-							__m128i b = _mm_loadu_si128((__m128i*)&data[bytepos - 16]);
-							int match_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
-							if((match_mask & rev_model) == rev_model)
-							{
-								assert(bytepos >= 0);	// bytepos = -1 should always hit empty bucket
-								unsigned int c0 = entry_ptr->c[0];
-								unsigned int c1 = entry_ptr->c[1];
-
-								entry_ptr->c[bit]++;
-								entry_ptr->c[1 - bit] = (entry_ptr->c[1 - bit] + 1) >> 1;
-								
-								unsigned int factor = (c0 == 0 || c1 == 0) ? boost_factor : 1;
-
-								SEncodeEntry& encode_entry = encode_entries[bitpos*inputSize + bytepos];
-								encode_entry.n[0] += c0 * factor;
-								encode_entry.n[1] += c1 * factor;
-								break;
-							}
+							assert(bytepos >= 0);	// bytepos = -1 should always hit empty bucket
+							unsigned int c0 = entry_ptr->c[0];
+							unsigned int c1 = entry_ptr->c[1];
+
+							entry_ptr->c[bit]++;
+							entry_ptr->c[1 - bit] = (entry_ptr->c[1 - bit] + 1) >> 1;
+							
+							unsigned int factor = (c0 == 0 || c1 == 0) ? boost_factor : 1;
+
+							SEncodeEntry& encode_entry = thread_entries[bitpos*inputSize + bytepos];
+							encode_entry.n[0] += c0 * factor;
+							encode_entry.n[1] += c1 * factor;
+							break;
 						}
-						
-						entry_idx++;
-						if(entry_idx >= (unsigned int)hash_table_size) entry_idx = 0;
 					}
+					
+					entry_idx++;
+					if(entry_idx >= (unsigned int)hash_table_size) entry_idx = 0;
 				}
 			}
 		}
+	});
+
+	local_entries.combine_each([&](const std::vector<SEncodeEntry>& entries)
+	{
+		for (int i = 0; i < 8 * inputSize; i++)
+		{
+			encode_entries[i].n[0] += entries[i].n[0];
+			encode_entries[i].n[1] += entries[i].n[1];
+		}
+	});
+}
+
+int EvaluateSize1k(const unsigned char* orgInputData, int inputSize, const ModelList1k& modelList)
+{
+	unsigned char* data = new unsigned char[inputSize + 32];
+	memset(data, 0, 32);
+	data += 32;
+	memcpy(data, orgInputData, inputSize);
+
+	SEncodeEntry* encode_entries = new SEncodeEntry[8 * inputSize];
+	memset(encode_entries, 0, 8 * inputSize * sizeof(SEncodeEntry));
+
+	Compute1kEncodeEntries(data, inputSize, modelList.modelmask, modelList.boost, encode_entries);
+
+	// Ideal size of the bits as coded by Compress1k
+	long long totalsize = 0;
+	for (int bytepos = 0; bytepos < inputSize; bytepos++)
+	{
+		for (int bitpos = 0; bitpos < 8; bitpos++)
+		{
+			int bit = ((data[bytepos] << bitpos) & 0x80) == 0x80;
+			const SEncodeEntry& entry = encode_entries[bitpos*inputSize + bytepos];
+			int zero_prob = entry.n[1] + modelList.baseprob0;
+			int one_prob = entry.n[0] + modelList.baseprob1;
+			totalsize += bit ? AritSize2(zero_prob, one_prob) : AritSize2(one_prob, zero_prob);
+		}
 	}
-	);
 
-	delete[] hash_table_data;
+	delete[] encode_entries;
+
+	data -= 32;
+	delete[] data;
+
+	return (int)(totalsize / (TABLE_BIT_PRECISION / BIT_PRECISION));
+}
+
+int Compress1k(const unsigned char* orgInputData, int inputSize, unsigned char* outCompressedData, int maxCompressedSize, ModelList1k& modelList, int* sizefill, int* outInternalSize)
+{
+	int boost_factor = modelList.boost;
+	int b0 = modelList.baseprob0;
+	int b1 = modelList.baseprob1;
+	unsigned int modelmask = modelList.modelmask;
+
+	unsigned char* data = new unsigned char[inputSize + 32];
+	memset(data, 0, 32);
+	data += 32;
+	memcpy(data, orgInputData, inputSize);
+
+	SEncodeEntry* encode_entries = new SEncodeEntry[8 * inputSize];
+	memset(encode_entries, 0, 8 * inputSize * sizeof(SEncodeEntry));
+
+	Compute1kEncodeEntries(data, inputSize, modelmask, boost_factor, encode_entries);
 
 	AritState as;
 	memset(outCompressedData, 0, maxCompressedSize);
@@ -631,46 +777,71 @@ int Compress1k(const unsigned char* orgInputData, int inputSize, unsigned char*
 	return (AritCodeEnd(&as) + 7) / 8;
 }
 
-int Evaluate1K(unsigned char* data, int size, int* modeldata, int* out_b0, int* out_b1, int* out_boost_factor, unsigned int modelmask)
+// LogTable lookup with the normalization of AritSize2, such that AritSize2(right, wrong) == LogSize(right + wrong) - LogSize(right)
+static int LogSize(int prob)
+{
+	unsigned long len;
+	_BitScanReverse(&len, prob);
+	int shift = len > 12 ? len - 12 : 0;
+	return LogTable[prob >> shift] + (shift << 12);
+}
+
+// Add (sign = 1) or subtract (sign = -1) the counts of one model to the per-bit counts
+// (boost_n0, boost_n1, no_boost_n0, no_boost_n1 for every bit).
+static void Accumulate1kCounts(const int* modeldata, int bitlength, int model_idx, int sign, int* counts)
+{
+	for (int i = 0; i < bitlength; i++)
+	{
+		int c0 = modeldata[(bitlength*model_idx + i) * 2];
+		int c1 = modeldata[(bitlength*model_idx + i) * 2 + 1];
+		int boost = (c0 * c1 == 0);
+		counts[i * 4 + boost * 2] += c0 * sign;
+		counts[i * 4 + boost * 2 + 1] += c1 * sign;
+	}
+}
+
+// Evaluate the model set given by counts (see Accumulate1kCounts) with one model removed, or
+// the set itself if removed_model_idx is -1.
+static int Evaluate1K(const unsigned char* data, int size, const int* modeldata, const int* counts, int removed_model_idx, int* out_b0, int* out_b1, int* out_boost_factor)
 {
 	int bitlength = size * 8;
-	int totalsizes[NUM_1K_BOOST_FACTORS][NUM_1K_BASEPROBS][NUM_1K_BASEPROBS] = {};
+	const int* removed = removed_model_idx >= 0 ? &modeldata[bitlength * removed_model_idx * 2] : nullptr;
+
+	// The size of a bit is LogSize(total + b0 + b1) - LogSize(right + b), where b is b0 for 1 bits and b1 for 0 bits.
+	// Instead of evaluating all baseprob combinations, sum the 9 total terms and the 5 right terms of each kind
+	// separately and combine them at the end. Consecutive LogTable entries are summed four at a time.
+	// The 32-bit lanes are flushed to 64-bit sums regularly to avoid overflow.
+	const int NUM_TOTAL_TERMS = NUM_1K_BASEPROBS * 2 - 1;
+	const int FLUSH_INTERVAL = 8192;
+	long long total_terms[NUM_1K_BOOST_FACTORS][12] = {};
+	long long right_terms[2][NUM_1K_BOOST_FACTORS][8] = {};
+	__m128i total_acc[NUM_1K_BOOST_FACTORS][3];
+	__m128i right_acc[2][NUM_1K_BOOST_FACTORS][2];
 
 	for (int i = 0; i < bitlength; i++)
 	{
+		if ((i % FLUSH_INTERVAL) == 0)
+		{
+			for (int boost_idx = 0; boost_idx < NUM_1K_BOOST_FACTORS; boost_idx++)
+			{
+				for (int j = 0; j < 3; j++)
+					total_acc[boost_idx][j] = _mm_setzero_si128();
+				for (int j = 0; j < 2; j++)
+					right_acc[0][boost_idx][j] = right_acc[1][boost_idx][j] = _mm_setzero_si128();
+			}
+		}
+
 		int bitpos = (i & 7);
 		int bytepos = i >> 3;
-		int mask = 0xFF00 >> bitpos;
 		int bit = ((data[bytepos] << bitpos) & 0x80) == 0x80;
 
-		int n[2][2] = {};	// boost_n0, boost_n1, no_boost_n0, no_boost_n1
-
-		unsigned int mmask = modelmask;
-
-		int model = 31;
-		
+		int n[2][2] = { { counts[i * 4], counts[i * 4 + 1] }, { counts[i * 4 + 2], counts[i * 4 + 3] } };	// boost_n0, boost_n1, no_boost_n0, no_boost_n1
+		if (removed)
 		{
-			lala:
-			int model_idx = model + 1;
-			int c[2] = { modeldata[(bitlength*model_idx + i) * 2], modeldata[(bitlength*model_idx + i) * 2 + 1] };
+			int c[2] = { removed[i * 2], removed[i * 2 + 1] };
 			int boost = (c[0] * c[1] == 0);
-			n[boost][0] += c[0];
-			n[boost][1] += c[1];
-			
-		skip:
-			bool handle = (((unsigned int)mmask) & 0x80000000) != 0;
-			if(mmask == 0)
-				goto end;
-			mmask <<= 1;
-
-			
-			model--;
-			if(handle)
-				goto lala;
-			else
-				goto skip;
-		end:
-			;
+			n[boost][0] -= c[0];
+			n[boost][1] -= c[1];
 		}
 
 		for (int boost_idx = 0; boost_idx < NUM_1K_BOOST_FACTORS; boost_idx++)
@@ -678,44 +849,82 @@ int Evaluate1K(unsigned char* data, int size, int* modeldata, int* out_b0, int*
 			int boost_factor = boost_idx + MIN_1K_BOOST_FACTOR;
 			int total_n0 = n[0][0] + n[1][0] * boost_factor;
 			int total_n1 = n[0][1] + n[1][1] * boost_factor;
-			for (int b1 = 0; b1 < NUM_1K_BASEPROBS; b1++)
+			int total = total_n0 + total_n1 + 2 * MIN_1K_BASEPROB;
+			int right = total_n0 + MIN_1K_BASEPROB;
+
+			__m128i t0, t1, t2, r0, r1;
+			if (total + 12 <= TABLE_BIT_PRECISION * 2)
+			{
+				// No normalization needed, LogTable entries are used directly
+				t0 = _mm_loadu_si128((const __m128i*)&LogTable[total]);
+				t1 = _mm_loadu_si128((const __m128i*)&LogTable[total + 4]);
+				t2 = _mm_loadu_si128((const __m128i*)&LogTable[total + 8]);
+				r0 = _mm_loadu_si128((const __m128i*)&LogTable[right]);
+				r1 = _mm_loadu_si128((const __m128i*)&LogTable[right + 4]);
+			}
+			else
 			{
-				for (int b0 = 0; b0 < NUM_1K_BASEPROBS; b0++)
+				int t[12], r[8];
+				for (int j = 0; j < 12; j++)
+					t[j] = LogSize(total + j);
+				for (int j = 0; j < 8; j++)
+					r[j] = LogSize(right + j);
+				t0 = _mm_loadu_si128((const __m128i*)&t[0]);
+				t1 = _mm_loadu_si128((const __m128i*)&t[4]);
+				t2 = _mm_loadu_si128((const __m128i*)&t[8]);
+				r0 = _mm_loadu_si128((const __m128i*)&r[0]);
+				r1 = _mm_loadu_si128((const __m128i*)&r[4]);
+			}
+			total_acc[boost_idx][0] = _mm_add_epi32(total_acc[boost_idx][0], t0);
+			total_acc[boost_idx][1] = _mm_add_epi32(total_acc[boost_idx][1], t1);
+			total_acc[boost_idx][2] = _mm_add_epi32(total_acc[boost_idx][2], t2);
+			right_acc[bit][boost_idx][0] = _mm_add_epi32(right_acc[bit][boost_idx][0], r0);
+			right_acc[bit][boost_idx][1] = _mm_add_epi32(right_acc[bit][boost_idx][1], r1);
+		}
+
+		if (((i + 1) % FLUSH_INTERVAL) == 0 || i + 1 == bitlength)
+		{
+			for (int boost_idx = 0; boost_idx < NUM_1K_BOOST_FACTORS; boost_idx++)
+			{
+				int t[12], r[2][8];
+				for (int j = 0; j < 3; j++)
+					_mm_storeu_si128((__m128i*)&t[j * 4], total_acc[boost_idx][j]);
+				for (int j = 0; j < 2; j++)
 				{
-					int n0, n1;
-					if (bit)
-					{
-						n0 = total_n0 + b0 + MIN_1K_BASEPROB; n1 = total_n1 + b1 + MIN_1K_BASEPROB;
-					}
-					else
-					{
-						n0 = total_n0 + b1 + MIN_1K_BASEPROB; n1 = total_n1 + b0 + MIN_1K_BASEPROB;
-					}
-					totalsizes[boost_idx][b1][b0] += AritSize2(n0, n1);
+					_mm_storeu_si128((__m128i*)&r[0][j * 4], right_acc[0][boost_idx][j]);
+					_mm_storeu_si128((__m128i*)&r[1][j * 4], right_acc[1][boost_idx][j]);
+				}
+				for (int j = 0; j < NUM_TOTAL_TERMS; j++)
+					total_terms[boost_idx][j] += t[j];
+				for (int j = 0; j < NUM_1K_BASEPROBS; j++)
+				{
+					right_terms[0][boost_idx][j] += r[0][j];
+					right_terms[1][boost_idx][j] += r[1][j];
 				}
 			}
 		}
 	}
 
-	int min_totalsize = INT_MAX;
+	long long min_totalsize = LLONG_MAX;
 	for (int boost_idx = 0; boost_idx < NUM_1K_BOOST_FACTORS; boost_idx++)
 	{
 		for (int b1 = 0; b1 < NUM_1K_BASEPROBS; b1++)
 		{
 			for (int b0 = 0; b0 < NUM_1K_BASEPROBS; b0++)
 			{
-				if (totalsizes[boost_idx][b1][b0] < min_totalsize)
+				long long totalsize = total_terms[boost_idx][b0 + b1] - right_terms[1][boost_idx][b0] - right_terms[0][boost_idx][b1];
+				if (totalsize < min_totalsize)
 				{
 					*out_b0 = b0 + MIN_1K_BASEPROB;
 					*out_b1 = b1 + MIN_1K_BASEPROB;
 					*out_boost_factor = boost_idx + MIN_1K_BOOST_FACTOR;
-					min_totalsize = totalsizes[boost_idx][b1][b0];
+					min_totalsize = totalsize;
 				}
 			}
 		}
 	}
 
-	return (min_totalsize / (TABLE_BIT_PRECISION / BIT_PRECISION));
+	return (int)(min_totalsize / (TABLE_BIT_PRECISION / BIT_PRECISION));
 }
 
 ModelList1k ApproximateModels1k(const unsigned char* orgInputData, int inputSize, int* outCompressedSize, ProgressCallback* progressCallback, void* progressUserData)
@@ -727,6 +936,14 @@ ModelList1k ApproximateModels1k(const unsigned char* orgInputData, int inputSize
 
 	int* modeldata = GenerateModelData1k(orgInputData, inputSize);
 
+	// Per-bit counts of the current model set, starting with all models enabled
+	int* counts = new int[inputSize * 8 * 4];
+	memset(counts, 0, inputSize * 8 * 4 * sizeof(int));
+	for (int model_idx = 0; model_idx < NUM_1K_MODELS; model_idx++)
+	{
+		Accumulate1kCounts(modeldata, inputSize * 8, model_idx, 1, counts);
+	}
+
 	int best_size = INT_MAX;
 
 	unsigned int best_modelmask = 0xFFFFFFFF;	// Bit 31 must always be set
@@ -772,7 +989,7 @@ ModelList1k ApproximateModels1k(const unsigned char* orgInputData, int inputSize
 				int boost_factor;
 				int testsize;
 				int b0, b1;
-				testsize = Evaluate1K(data, inputSize, modeldata, &b0, &b1, &boost_factor, modelmask);
+				testsize = Evaluate1K(data, inputSize, modeldata, counts, model_idx, &b0, &b1, &boost_factor);
 
 				Concurrency::critical_section::scoped_lock l(cs);
 				if (testsize < best_size)
@@ -790,6 +1007,16 @@ ModelList1k ApproximateModels1k(const unsigned char* orgInputData, int inputSize
 		});
 		num_models--;
 
+		if (best_flip != -1)
+		{
+			// Remove the flipped model from the running counts
+			unsigned int removed_mask = prev_best_modelmask ^ best_modelmask;
+			int removed_model_idx = 0;
+			while ((removed_mask >> removed_model_idx) != 1)
+				removed_model_idx++;
+			Accumulate1kCounts(modeldata, inputSize * 8, removed_model_idx, -1, counts);
+		}
+
 		if (progressCallback)
 		{
 			if (best_flip == -1)
@@ -804,6 +1031,7 @@ ModelList1k ApproximateModels1k(const unsigned char* orgInputData, int inputSize
 	}
 
 	delete[] modeldata;
+	delete[] counts;
 
 	data -= 16;
 	delete[] data;
@@ -820,9 +1048,4 @@ ModelList1k ApproximateModels1k(const unsigned char* orgInputData, int inputSize
 	}
 
 	return model;
-}
-
-void InitCompressor()
-{
-	InitCounterStates();
 }
\ No newline at end of file
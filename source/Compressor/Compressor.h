@@ -12,17 +12,19 @@ static const int BIT_PRECISION		=	256;	// Number of units per bit
 
 typedef void	(ProgressCallback)(void* userData, int value, int max);
 
-void			InitCompressor();
-
 const char*		CompressionTypeName(CompressionType ct);
 
 ModelList1k		ApproximateModels1k(const unsigned char* inputData, int inputSize, int* outCompressedSize, ProgressCallback* progressCallback, void* progressUserData);
 int				Compress1k(const unsigned char* inputData, int inputSize, unsigned char* outCompressedData, int maxCompressedSize, ModelList1k& modelList, int* sizefill, int* outInternalSize);
+int				EvaluateSize1k(const unsigned char* inputData, int inputSize, const ModelList1k& modelList);
 
 ModelList4k		InstantModels4k();
 ModelList4k		ApproximateModels4k(const unsigned char* inputData, int inputSize, const unsigned char context[MAX_CONTEXT_LENGTH], CompressionType compressionType, bool saturate, int baseprob, int* outCompressedSize, ProgressCallback* progressCallback, void* progressUserData);
 int				EvaluateSize4k(const unsigned char* inputData, int numSegments, const int* segmentSizes, int* outCompressedSegmentSizes, ModelList4k** modelLists, int baseprob, bool saturate);
+int				EvaluateSegmentSize4k(const unsigned char* inputData, int segmentOffset, int segmentSize, ModelList4k& modelList, int baseprob, bool saturate, int* outByteCosts);
 int				Compress4k(const unsigned char* inputData, int numSegments, const int* segmentSizes, unsigned char* outCompressedData, int maxCompressedSize, ModelList4k** modelLists, bool saturate, int baseprob, int hashsize, int* sizefill);
 int				CompressFromHashBits4k(const HashBits* hashbits, TinyHashEntry** hashtables, int numSegments, unsigned char* outCompressedData, int maxCompressedSize, bool saturate, int baseprob, int hashsize, int* sizefill);
+void			CompressFromHashBitsBatch4k(const HashBits* hashbits, TinyHashEntry** hashtables, int numSegments, unsigned char** outCompressedData, int maxCompressedSize, bool saturate, int baseprob, const int* hashsizes, int numHashsizes, int* outCompressedSizes, const std::atomic<int>* sizeLimit);
+void			PredictHashCollisions4k(const HashBits* hashbits, int numSegments, const int* hashsizes, int numHashsizes, long long* outCollisions);
 
 #endif
@@ -1,72 +1,81 @@
 #include "CounterState.h"
 
-#include <memory>
-#include <cassert>
-
-CounterState unsaturated_counter_states[1471];
-CounterState saturated_counter_states[1470];
-
-static int counter_to_state[256][256];
-
-static int CounterVisit(CounterState* states, int& next_state, int max_states, unsigned char c0, unsigned char c1, int next_bit, bool saturate)
+// Enumerates all counter pairs reachable from (1,0) and (0,1) in depth-first order,
+// visiting the successor for a 0 bit before the one for a 1 bit.
+// The recursion is unrolled into an explicit stack to stay within constexpr evaluation limits.
+template<int N>
+static constexpr CounterStateTable<N> GenerateCounterStates(bool saturate)
 {
-	if (next_bit == 0)
-	{
-		if (!saturate || c0 < 255) c0++;
-		if (c1 > 1) c1 >>= 1;
-	}
-	else
-	{
-		if (!saturate || c1 < 255) c1++;
-		if (c0 > 1) c0 >>= 1;
-	}
-
-	if (counter_to_state[c1][c0] != -1)
-		return counter_to_state[c1][c0];
-
-	int boost = (c0 == 0 || c1 == 0) ? 2 : 0;
+	CounterStateTable<N> table = {};
 
-	int state_idx = next_state;
-	counter_to_state[c1][c0] = state_idx;
+	short counter_to_state[256][256] = {};
+	for (int c1 = 0; c1 < 256; c1++)
+		for (int c0 = 0; c0 < 256; c0++)
+			counter_to_state[c1][c0] = -1;
 
-	assert(next_state < max_states);
-	CounterState& s = states[next_state++];
-	s.boosted_counters[0] = c0 << boost;
-	s.boosted_counters[1] = c1 << boost;
-
-	states[state_idx].next_state[0] = CounterVisit(states, next_state, max_states, c0, c1, 0, saturate);
-	states[state_idx].next_state[1] = CounterVisit(states, next_state, max_states, c0, c1, 1, saturate);
-	return state_idx;
-}
+	struct Frame
+	{
+		int state;
+		unsigned char c0, c1;
+		int next_bit;
+	};
+	Frame stack[N] = {};
+	int stack_size = 0;
 
-static void GenerateCounterStates(CounterState* states, int max_states, bool saturate)
-{
-	memset(counter_to_state, -1, sizeof(counter_to_state));
-	
 	counter_to_state[0][1] = 0;
 	counter_to_state[1][0] = 1;
+	table.states[0].boosted_counters[0] = 1 << 2;
+	table.states[1].boosted_counters[1] = 1 << 2;
+	stack[stack_size++] = { 1, 0, 1, 0 };
+	stack[stack_size++] = { 0, 1, 0, 0 };
+	int next_state = 2;
 
-	int next_state = 0;
+	while (stack_size > 0)
+	{
+		Frame& frame = stack[stack_size - 1];
+		if (frame.next_bit == 2)
+		{
+			stack_size--;
+			continue;
+		}
 
-	assert(next_state < max_states);
-	CounterState& s0 = states[next_state++];
-	s0.boosted_counters[0] = 1 << 2;
-	s0.boosted_counters[1] = 0;
+		int bit = frame.next_bit++;
+		unsigned char c0 = frame.c0;
+		unsigned char c1 = frame.c1;
+		if (bit == 0)
+		{
+			if (!saturate || c0 < 255) c0++;
+			if (c1 > 1) c1 >>= 1;
+		}
+		else
+		{
+			if (!saturate || c1 < 255) c1++;
+			if (c0 > 1) c0 >>= 1;
+		}
 
-	assert(next_state < max_states);
-	CounterState& s1 = states[next_state++];
-	s1.boosted_counters[0] = 0;
-	s1.boosted_counters[1] = 1 << 2;
+		if (counter_to_state[c1][c0] == -1)
+		{
+			int boost = (c0 == 0 || c1 == 0) ? 2 : 0;
+			int state = next_state++;
+			counter_to_state[c1][c0] = state;
+			table.states[state].boosted_counters[0] = c0 << boost;
+			table.states[state].boosted_counters[1] = c1 << boost;
+			stack[stack_size++] = { state, c0, c1, 0 };
+		}
+		table.states[frame.state].next_state[bit] = counter_to_state[c1][c0];
+	}
 
-	states[0].next_state[0] = CounterVisit(states, next_state, max_states, 1, 0, 0, saturate);
-	states[0].next_state[1] = CounterVisit(states, next_state, max_states, 1, 0, 1, saturate);
-	states[1].next_state[0] = CounterVisit(states, next_state, max_states, 0, 1, 0, saturate);
-	states[1].next_state[1] = CounterVisit(states, next_state, max_states, 0, 1, 1, saturate);
-	assert(next_state == max_states);
+	return table;
 }
 
-void InitCounterStates()
-{
-	GenerateCounterStates(unsaturated_counter_states,	sizeof(unsaturated_counter_states) / sizeof(unsaturated_counter_states[0]),	false);
-	GenerateCounterStates(saturated_counter_states,		sizeof(saturated_counter_states) / sizeof(saturated_counter_states[0]),		true);
-}
\ No newline at end of file
+// Generated into constexpr objects, so tables that cannot be evaluated at compile time are a build
+// error instead of dynamic initializers. The exported tables are then constant initialized from them.
+static constexpr CounterStateTable<1471> generated_unsaturated_counter_states = GenerateCounterStates<1471>(false);
+static constexpr CounterStateTable<1470> generated_saturated_counter_states = GenerateCounterStates<1470>(true);
+static_assert(generated_unsaturated_counter_states.states[0].next_state[1] == 1216, "Counter states generated incorrectly");
+static_assert(generated_unsaturated_counter_states.states[1470].boosted_counters[1] == 1020, "Counter states generated incorrectly");
+static_assert(generated_saturated_counter_states.states[0].next_state[1] == 1215, "Counter states generated incorrectly");
+static_assert(generated_saturated_counter_states.states[1469].next_state[1] == 1469, "Counter states generated incorrectly");
+
+const CounterStateTable<1471> unsaturated_counter_states = generated_unsaturated_counter_states;
+const CounterStateTable<1470> saturated_counter_states = generated_saturated_counter_states;
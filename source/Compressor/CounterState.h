@@ -8,9 +8,14 @@ struct CounterState
 	unsigned short next_state[2];
 };
 
-CounterState unsaturated_counter_states[];
-CounterState saturated_counter_states[];
+template<int N>
+struct CounterStateTable
+{
+	CounterState states[N];
+};
 
-void InitCounterStates();
+// Generated at compile time. No initialization needed.
+extern const CounterStateTable<1471> unsaturated_counter_states;
+extern const CounterStateTable<1470> saturated_counter_states;
 
 #endif
\ No newline at end of file
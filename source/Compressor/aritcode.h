@@ -7,9 +7,8 @@
 #include <intrin.h>
 #else
 #include <x86intrin.h>
-static inline void _BitScanReverse(uint32_t *index, uint32_t mask) {
-	const int leading_bits = __builtin_clz(mask);
-	*index = 1 << (32 - leading_bits);
+static inline void _BitScanReverse(unsigned long *index, unsigned long mask) {
+	*index = 31 - __builtin_clz((unsigned int)mask);
 }
 #define __cdecl
 #endif
@@ -29,22 +28,28 @@ void			AritCode(struct AritState *state, unsigned int zero_prob, unsigned int on
 unsigned int	AritCodePos(struct AritState *state);
 int __cdecl		AritCodeEnd(struct AritState *state);
 
-extern "C"
-{
-	extern int LogTable[];
-}
+// LogTable[i] is 4096 * log2(i / 4096), rounded, plus one for i < 4096. Generated at compile time.
+struct LogTableData {
+	int values[TABLE_BIT_PRECISION * 2];
+
+	const int& operator[](int i) const { return values[i]; }
+};
+extern const LogTableData LogTable;
 
 inline int AritSize2(int right_prob, int wrong_prob) {
 	assert(right_prob > 0);
 	assert(wrong_prob > 0);
 
+	unsigned long right_bits, total_bits;
 	int right_len, total_len;
 	int total_prob = right_prob + wrong_prob;
 	if(total_prob < TABLE_BIT_PRECISION) {
 		return LogTable[total_prob] - LogTable[right_prob];
 	}
-	_BitScanReverse((unsigned*)&right_len, right_prob);
-	_BitScanReverse((unsigned*)&total_len, total_prob);
+	_BitScanReverse(&right_bits, right_prob);
+	_BitScanReverse(&total_bits, total_prob);
+	right_len = right_bits;
+	total_len = total_bits;
 	right_len = right_len > 12 ? (right_len - 12) : 0;
 	total_len = total_len > 12 ? (total_len - 12) : 0;
 	return LogTable[total_prob >> total_len] - LogTable[right_prob >> right_len] + ((total_len - right_len) << 12);
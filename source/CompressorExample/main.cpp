@@ -54,10 +54,6 @@ int main(int argc, const char* argv[])
 	fread(data, dataSize, 1, file);
 	fclose(file);
 
-	// Initialize compressor
-	// Needs to be called before any other call to the compressor
-	InitCompressor();
-
 	printf("Uncompressed size: %d bytes\n", dataSize);
 
 	// Calculate models for data
@@ -15,7 +15,7 @@ Hunk* CallTransform::GetDetransformer() {
 	return h;
 }
 
-bool CallTransform::DoTransform(Hunk* hunk, int splittingPoint, bool verbose) {
+bool CallTransform::DoTransform(Hunk* hunk, int splittingPoint, bool verbose) const {
 	unsigned char* data = (unsigned char*)hunk->GetPtr();
 	int size = splittingPoint;
 
@@ -41,8 +41,6 @@ bool CallTransform::DoTransform(Hunk* hunk, int splittingPoint, bool verbose) {
 		memset(hunk->GetPtr()+start, 0x90, size);
 		if (verbose)
 			Log::Warning("", "No calls - call transformation not applied");
-		// Do not run call trans next time
-		Disable();
 		return false;
 	}
 }
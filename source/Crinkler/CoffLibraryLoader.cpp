@@ -5,6 +5,7 @@
 #include "HunkList.h"
 #include "CoffObjectLoader.h"
 #include "Hunk.h"
+#include "MemoryFile.h"
 #include "misc.h"
 #include "NameMangling.h"
 #include "Symbol.h"
@@ -31,122 +32,224 @@ bool CoffLibraryLoader::Clicks(const char* data, int size) const {
 }
 
 HunkList* CoffLibraryLoader::Load(const char* data, int size, const char* module) {
+	CoffLibrary library(data, size, module);
+	return library.LoadAll();
+}
+
+CoffLibrary::CoffLibrary(const char* data, int size, const char* module, MemoryFile* file) :
+	m_data(data), m_size(size), m_file(file), m_module(module)
+{
 	// Assume that the header and first linker member are fine (as it is checked by click)
-	
-	HunkList* hunklist = new HunkList;
 	const char* ptr = data + 8;
 	// Skip first linker member
 	int memberSize = atoi(&ptr[48]);
 	const char *next = ptr + 60 + memberSize;
 	next += memberSize & 1;
 
-	int numberOfSymbols;
-	int numberOfMembers;
-	const int* offsets;
-	unsigned short* indices;
 	if (memcmp(next, "/               ", 16)) {
 		//only first linker member present
 		ptr += 60;
 
-		numberOfSymbols = ReadBigEndian((const unsigned char*)ptr);
+		m_numberOfSymbols = ReadBigEndian((const unsigned char*)ptr);
 		ptr += sizeof(int);
-		numberOfMembers = numberOfSymbols;
+		m_numberOfMembers = m_numberOfSymbols;
 
-		offsets = ((int*)ptr);
-		ptr += numberOfMembers * sizeof(int);
+		m_offsets = ((int*)ptr);
+		ptr += m_numberOfMembers * sizeof(int);
 
-		indices = nullptr;
+		m_indices = nullptr;
 	} else {
 		// Second linker member
 		ptr = next + 60;
 
-		numberOfMembers = *((int*)ptr);
+		m_numberOfMembers = *((int*)ptr);
 		ptr += sizeof(int);
 
-		offsets = ((int*)ptr);
-		ptr += numberOfMembers * sizeof(int);
-		numberOfSymbols = *((int*)ptr);
+		m_offsets = ((int*)ptr);
+		ptr += m_numberOfMembers * sizeof(int);
+		m_numberOfSymbols = *((int*)ptr);
 		ptr += sizeof(int);
 
-		indices = (unsigned short*)ptr;
-		ptr += numberOfSymbols * sizeof(unsigned short);
+		m_indices = (unsigned short*)ptr;
+		ptr += m_numberOfSymbols * sizeof(unsigned short);
 	}
 
 	// Make symbol names table
-	vector<const char*> symbolNames(numberOfSymbols);
-	for(int i = 0; i < numberOfSymbols; i++) {
-		symbolNames[i] = ptr;
+	m_symbolNames.resize(m_numberOfSymbols);
+	m_symbolIndex.reserve(m_numberOfSymbols);
+	for(int i = 0; i < m_numberOfSymbols; i++) {
+		m_symbolNames[i] = ptr;
+		m_symbolIndex.insert(make_pair(PooledString(ptr), i));
 		ptr += strlen(ptr) + 1;
 	}
+}
+
+CoffLibrary::~CoffLibrary() {
+	delete m_file;
+}
+
+int CoffLibrary::GetMemberOffset(int member) const {
+	return m_indices ? m_offsets[member] : ReadBigEndian((const unsigned char*)&m_offsets[member]);
+}
+
+int CoffLibrary::GetSymbolMember(int symbol) const {
+	if(symbol >= m_numberOfSymbols)
+		return symbol - m_numberOfSymbols;
+	return m_indices ? m_indices[symbol] - 1 : symbol;
+}
+
+bool CoffLibrary::IsImportMember(int offset) const {
+	return *(int*)(m_data + offset + 60) == 0xFFFF0000;
+}
+
+HunkList* CoffLibrary::LoadObjectMember(int member, int offset) const {
+	char memberModuleName[256];
+	sprintf_s(memberModuleName, 256, "%s|%d", m_module.c_str(), member);
+	CoffObjectLoader coffLoader;
+	return coffLoader.Load(m_data + offset + 60, 0, memberModuleName);
+}
+
+Hunk* CoffLibrary::LoadImport(int symbol, int offset) const {
+	const char* ptr = m_data + offset + 60;
+	unsigned short flags = *((unsigned short*) &ptr[18]);
+	unsigned int nameType = (flags >> 2) & 7;
+
+	ptr += 20;
+	string importName = ptr;
+	ptr += strlen(ptr) + 1;
+	const char* importDLL = ptr;
+
+	switch(nameType) {
+		case IMPORT_OBJECT_NAME_NO_PREFIX:
+			importName = StripSymbolPrefix(importName.c_str());
+			break;
+		case IMPORT_OBJECT_NAME:
+			break;
+		case IMPORT_OBJECT_NAME_UNDECORATE:
+		default:
+			importName = UndecorateSymbolName(importName.c_str());
+			break;
+	}
+
+	const char* symbolName = m_symbolNames[symbol];
+	if(strlen(symbolName) >= 6 && memcmp(symbolName, "__imp_", 6) == 0) {
+		// An import
+		char dllName[256] = {};
+		for(int j = 0; importDLL[j] && importDLL[j] != '.'; j++)
+			dllName[j] = (char)tolower(importDLL[j]);
+
+		return new Hunk(symbolName, importName.c_str(), dllName);
+	} else {
+		// A call stub
+		return MakeCallStub(symbolName);
+	}
+}
+
+HunkList* CoffLibrary::LoadAll() const {
+	HunkList* hunklist = new HunkList;
 
 	// Add COFF
 	int prev_offset = 0;
-	for(int i = 0; i < numberOfMembers; i++) {
-		char memberModuleName[256];
-		sprintf_s(memberModuleName, 256, "%s|%d", module, i);
-		int offset = indices ? offsets[i] : ReadBigEndian((const unsigned char*)&offsets[i]);
+	for(int i = 0; i < m_numberOfMembers; i++) {
+		int offset = GetMemberOffset(i);
 		if (offset == 0 || offset == prev_offset) continue;
 		prev_offset = offset;
-		ptr = data + offset;
-		ptr += 60;	// Skip member header
 
-		// COFF
-		if(*(int*)ptr != 0xFFFF0000) {
-			CoffObjectLoader coffLoader;
-			HunkList* hl = coffLoader.Load(ptr, 0, memberModuleName);
+		if(!IsImportMember(offset)) {
+			HunkList* hl = LoadObjectMember(i, offset);
 			hunklist->Append(hl);
 			delete hl;
 		}
 	}
 
 	// Add imports
-	for(int i = 0; i < numberOfSymbols; i++) {
-		int idx = indices ? indices[i] - 1 : i;
-		int offset = indices ? offsets[idx] : ReadBigEndian((const unsigned char*)&offsets[idx]);
+	for(int i = 0; i < m_numberOfSymbols; i++) {
+		int offset = GetMemberOffset(GetSymbolMember(i));
 		if (offset == 0) continue;
-		ptr = data + offset;
-		ptr += 60;
 
-		if(*(int*)ptr == 0xFFFF0000) {	// Import
-			unsigned short flags = *((unsigned short*) &ptr[18]);
-			unsigned int nameType = (flags >> 2) & 7;
-
-			ptr += 20;
-			string importName = ptr;
-			ptr += strlen(ptr) + 1;
-			const char* importDLL = ptr;
-
-			switch(nameType) {
-				case IMPORT_OBJECT_NAME_NO_PREFIX:
-					importName = StripSymbolPrefix(importName.c_str());
-					break;
-				case IMPORT_OBJECT_NAME:
-					break;
-				case IMPORT_OBJECT_NAME_UNDECORATE:
-				default:
-					importName = UndecorateSymbolName(importName.c_str());
-					break;
-			}
-
-			if(strlen(symbolNames[i]) >= 6 && memcmp(symbolNames[i], "__imp_", 6) == 0) {
-				// An import
-				char dllName[256] = {};
-				for(int j = 0; importDLL[j] && importDLL[j] != '.'; j++)
-					dllName[j] = (char)tolower(importDLL[j]);
-
-				hunklist->AddHunkBack(new Hunk(symbolNames[i], importName.c_str(), dllName));
-			} else {
-				// A call stub
-				hunklist->AddHunkBack(MakeCallStub(symbolNames[i]));
-			}
+		if(IsImportMember(offset)) {
+			hunklist->AddHunkBack(LoadImport(i, offset));
+		}
+	}
+
+	hunklist->MarkHunksAsLibrary();
+
+	return hunklist;
+}
+
+bool CoffLibrary::ClaimSymbol(const PooledString& name, int& symbol) {
+	auto it = m_symbolIndex.find(name);
+	if(it == m_symbolIndex.end())
+		return false;
+	symbol = it->second;
+	m_symbolIndex.erase(it);
+
+	int offset = GetMemberOffset(GetSymbolMember(symbol));
+	if(offset == 0)
+		return false;
+
+	// Each symbol of an import member has its own hunk
+	if(!IsImportMember(offset) && !m_loadedMembers.insert(offset).second)
+		symbol = -1;
+	return true;
+}
+
+vector<int> CoffLibrary::GetInitializerSymbols() const {
+	vector<int> symbols;
+	int prev_offset = 0;
+	for(int i = 0; i < m_numberOfMembers; i++) {
+		int offset = GetMemberOffset(i);
+		if (offset == 0 || offset == prev_offset) continue;
+		prev_offset = offset;
+
+		if(!IsImportMember(offset) && CoffObjectLoader::HasDynamicInitializers(m_data + offset + 60)) {
+			symbols.push_back(m_numberOfSymbols + i);
 		}
 	}
+	return symbols;
+}
+
+void CoffLibrary::ClaimInitializers(vector<int>& symbols) {
+	for(int symbol : GetInitializerSymbols()) {
+		if(m_loadedMembers.insert(GetMemberOffset(GetSymbolMember(symbol))).second)
+			symbols.push_back(symbol);
+	}
+}
+
+int CoffLibrary::GetSymbolOrder(int symbol) const {
+	int offset = GetMemberOffset(GetSymbolMember(symbol));
+	if(offset == 0)
+		return -1;
+	return IsImportMember(offset) ? m_size + symbol : offset;
+}
 
+HunkList* CoffLibrary::LoadSymbol(int symbol, int* order) const {
+	int member = GetSymbolMember(symbol);
+	int offset = GetMemberOffset(member);
+
+	HunkList* hunklist;
+	if(IsImportMember(offset)) {
+		hunklist = new HunkList;
+		hunklist->AddHunkBack(LoadImport(symbol, offset));
+	} else {
+		hunklist = LoadObjectMember(member, offset);
+	}
 	hunklist->MarkHunksAsLibrary();
+	*order = GetSymbolOrder(symbol);
 
 	return hunklist;
 }
 
+bool CoffLibrary::FindUndecoratedSymbol(const char* name, PooledString& result) const {
+	for(const char* symbolName : m_symbolNames) {
+		if(UndecorateSymbolName(symbolName).compare(name) == 0) {
+			result = symbolName;
+			return true;
+		}
+	}
+	return false;
+}
+
 Hunk* MakeCallStub(const char* name) {
 	unsigned char stubData[6] = { 0xFF, 0x25, 0x00, 0x00, 0x00, 0x00 };
 	string hunkName = string("stub_for_") + name;
@@ -154,7 +257,7 @@ Hunk* MakeCallStub(const char* name) {
 	stubHunk->AddSymbol(new Symbol(name, 0, SYMBOL_IS_RELOCATEABLE, stubHunk));
 
 	Relocation r;
-	r.symbolname += string("__imp_") + name;
+	r.symbolname = string("__imp_") + name;
 	r.offset = 2;
 	r.type = RELOCTYPE_ABS32;
 	stubHunk->AddRelocation(r);
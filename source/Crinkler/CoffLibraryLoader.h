@@ -2,9 +2,17 @@
 #ifndef _COFF_LIBRARY_LOADER_H_
 #define _COFF_LIBRARY_LOADER_H_
 
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
 #include "HunkLoader.h"
+#include "StringPool.h"
+
 class Hunk;
 class HunkList;
+class MemoryFile;
 
 class CoffLibraryLoader : public HunkLoader {
 public:
@@ -12,6 +20,76 @@ public:
 	virtual HunkList*	Load(const char* data, int size, const char* module);
 };
 
+// Library whose members are loaded when one of their symbols is needed
+class LazyLibrary {
+public:
+	virtual ~LazyLibrary() {}
+
+	// Claim the member defining a symbol, so that it is loaded once. Returns false if no member
+	// defines the symbol. symbol is set to -1 if the member has already been claimed.
+	virtual bool		ClaimSymbol(const PooledString& name, int& symbol) = 0;
+
+	// Claim the members with dynamic initializers that have not been claimed yet, adding a
+	// symbol to load for each to symbols. These can be past the symbols of the symbol index.
+	virtual void		ClaimInitializers(std::vector<int>& symbols) = 0;
+
+	// Load the hunks for a claimed symbol. Can be called concurrently, so it does not report errors.
+	// order receives a key that sorts loaded hunks as in a full load.
+	virtual HunkList*	LoadSymbol(int symbol, int* order) const = 0;
+
+	// Find the decorated name of a symbol in the library symbol index
+	virtual bool		FindUndecoratedSymbol(const char* name, PooledString& result) const = 0;
+};
+
+// Library archive whose members are parsed when one of their symbols is needed,
+// using the symbol index of the archive linker member.
+class CoffLibrary : public LazyLibrary {
+	const char*					m_data;
+	int							m_size;
+	MemoryFile*					m_file;
+	std::string					m_module;
+
+	int							m_numberOfSymbols;
+	int							m_numberOfMembers;
+	const int*					m_offsets;
+	const unsigned short*		m_indices;		// Member per symbol, or NULL if only the first linker member is present
+	std::vector<const char*>	m_symbolNames;
+
+	std::unordered_map<PooledString, int, PooledString::Hash>	m_symbolIndex;		// Symbols not loaded yet
+	std::unordered_set<int>										m_loadedMembers;	// Offsets of claimed object members
+
+	int			GetMemberOffset(int member) const;
+	int			GetSymbolMember(int symbol) const;		// Symbols past the symbol index denote members
+	bool		IsImportMember(int offset) const;
+	HunkList*	LoadObjectMember(int member, int offset) const;
+	Hunk*		LoadImport(int symbol, int offset) const;
+public:
+	// The data must stay valid while the library is used. The library takes ownership of file, if given.
+	CoffLibrary(const char* data, int size, const char* module, MemoryFile* file = NULL);
+	~CoffLibrary();
+
+	// Load all members, in archive order
+	HunkList*	LoadAll() const;
+
+	virtual bool		ClaimSymbol(const PooledString& name, int& symbol);
+	virtual void		ClaimInitializers(std::vector<int>& symbols);
+	virtual HunkList*	LoadSymbol(int symbol, int* order) const;
+	virtual bool		FindUndecoratedSymbol(const char* name, PooledString& result) const;
+
+	// Symbols loading each object member with dynamic initializers, in archive order.
+	// The members are found from their section headers without loading them.
+	std::vector<int>	GetInitializerSymbols() const;
+
+	const char*	GetModule() const						{ return m_module.c_str(); }
+	int			GetSize() const							{ return m_size; }
+	int			GetNumSymbols() const					{ return m_numberOfSymbols; }
+	const char*	GetSymbolName(int symbol) const			{ return m_symbolNames[symbol]; }
+
+	// Order key of the hunks loaded for a symbol, as given by LoadSymbol. Symbols defined by
+	// the same object member have the same key. Returns -1 if no member defines the symbol.
+	int			GetSymbolOrder(int symbol) const;
+};
+
 Hunk* MakeCallStub(const char* name);
 
 #endif
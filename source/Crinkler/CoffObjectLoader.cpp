@@ -42,6 +42,13 @@ static string StripNumeral(const string& s) {
 	return s.substr(0, idx);
 }
 
+// Name of a symbol local to an object file, unique across modules
+static string LocalSymbolName(const char* module, int symbolIndex, const string& name) {
+	char localName[1000];
+	sprintf_s(localName, 1000, "l[%s(%d)]!%s", module, symbolIndex, name.c_str());
+	return localName;
+}
+
 CoffObjectLoader::~CoffObjectLoader() {
 }
 
@@ -50,6 +57,19 @@ bool CoffObjectLoader::Clicks(const char* data, int size) const {
 	return *(unsigned short*)data == IMAGE_FILE_MACHINE_I386;
 }
 
+bool CoffObjectLoader::HasDynamicInitializers(const char* data) {
+	const IMAGE_FILE_HEADER* header = (const IMAGE_FILE_HEADER*)data;
+	const IMAGE_SYMBOL* symbolTable = (const IMAGE_SYMBOL*)(data + header->PointerToSymbolTable);
+	const char* stringTable = (const char*)symbolTable + header->NumberOfSymbols*sizeof(IMAGE_SYMBOL);
+	const IMAGE_SECTION_HEADER* sectionHeaders = (const IMAGE_SECTION_HEADER*)(data + sizeof(IMAGE_FILE_HEADER));
+	for(int i = 0; i < header->NumberOfSections; i++) {
+		// Matches the hunks collected by Crinkler::CreateDynamicInitializerHunk
+		if(EndsWith(GetSectionName(&sectionHeaders[i], stringTable).c_str(), "CRT$XCU"))
+			return true;
+	}
+	return false;
+}
+
 HunkList* CoffObjectLoader::Load(const char* data, int size, const char* module) {
 	const char* ptr = data;
 
@@ -65,6 +85,7 @@ HunkList* CoffObjectLoader::Load(const char* data, int size, const char* module)
 	const IMAGE_SECTION_HEADER* sectionHeaders = (const IMAGE_SECTION_HEADER*)ptr;
 
 	HunkList* hunklist = new HunkList;
+	PooledString objectName = StripNumeral(StripPath(module));
 	Hunk* constantsHunk;
 	{
 		char hunkName[1000];
@@ -89,7 +110,8 @@ HunkList* CoffObjectLoader::Load(const char* data, int size, const char* module)
 		Hunk* hunk = new Hunk(hunkName, data+sectionHeaders[i].PointerToRawData,	// Data pointer
 								flags, GetAlignmentBitsFromCharacteristics(chars),	// Alignment
 								isInitialized ? sectionHeaders[i].SizeOfRawData : 0,
-								sectionHeaders[i].SizeOfRawData);	// Virtual size
+								sectionHeaders[i].SizeOfRawData,	// Virtual size
+								true);	// Reference the section data
 		hunklist->AddHunkBack(hunk);
 
 		// Relocations
@@ -102,10 +124,7 @@ HunkList* CoffObjectLoader::Load(const char* data, int size, const char* module)
 			string symbolName = GetSymbolName(symbol, stringTable);
 			if(symbol->StorageClass == IMAGE_SYM_CLASS_STATIC || 
 				symbol->StorageClass == IMAGE_SYM_CLASS_LABEL) {	// Local symbol reference
-				// Construct local name
-				char name[1000];
-				sprintf_s(name, 1000, "l[%s(%d)]!%s", module, symbolIndex, symbolName.c_str());
-				r.symbolname = name;
+				r.symbolname = LocalSymbolName(module, symbolIndex, symbolName);
 			} else {
 				r.symbolname = symbolName;
 			}
@@ -118,7 +137,7 @@ HunkList* CoffObjectLoader::Load(const char* data, int size, const char* module)
 				case IMAGE_REL_I386_REL32:
 					r.type = RELOCTYPE_REL32;
 			}
-			r.objectname = StripNumeral(StripPath(module));
+			r.objectname = objectName;
 			
 			hunk->AddRelocation(r);
 		}
@@ -137,7 +156,11 @@ HunkList* CoffObjectLoader::Load(const char* data, int size, const char* module)
 				continue;
 		}
 
-		Symbol* s = new Symbol(GetSymbolName(sym, stringTable).c_str(), sym->Value, SYMBOL_IS_RELOCATEABLE, 0);
+		bool isLocal = sym->StorageClass == IMAGE_SYM_CLASS_STATIC || sym->StorageClass == IMAGE_SYM_CLASS_LABEL;
+		string name = GetSymbolName(sym, stringTable);
+		if(sym->SectionNumber > 0 && isLocal)	// Perform name mangling on local symbols
+			name = LocalSymbolName(module, i, name);
+		Symbol* s = new Symbol(name.c_str(), sym->Value, SYMBOL_IS_RELOCATEABLE, 0);
 
 		if(sym->SectionNumber > 0) {
 			s->hunk = (*hunklist)[sym->SectionNumber-1];
@@ -148,12 +171,7 @@ HunkList* CoffObjectLoader::Load(const char* data, int size, const char* module)
 				s->size = aux->Sym.Misc.TotalSize;
 			}
 
-			if(sym->StorageClass == IMAGE_SYM_CLASS_STATIC ||	// Perform name mangling on local symbols
-				sym->StorageClass == IMAGE_SYM_CLASS_LABEL) {
-
-				char symname[1000];
-				sprintf_s(symname, 1000, "l[%s(%d)]!%s", module, i, s->name.c_str());
-				s->name = symname;
+			if(isLocal) {
 				s->flags |= SYMBOL_IS_LOCAL;
 				if(sym->StorageClass == IMAGE_SYM_CLASS_STATIC && sym->NumberOfAuxSymbols == 1) {
 					s->flags |= SYMBOL_IS_SECTION;
@@ -11,6 +11,9 @@ public:
 
 	virtual bool		Clicks(const char* data, int size) const;
 	virtual HunkList*	Load(const char* data, int size, const char* module);
+
+	// Check the section headers for dynamic initializers (.CRT$XCU) without loading the object
+	static bool			HasDynamicInitializers(const char* data);
 };
 
 #endif
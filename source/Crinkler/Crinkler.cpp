@@ -3,9 +3,14 @@
 #include "Fix.h"
 
 #include <set>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
 #include <ctime>
 #include <cstring>
 #include <climits>
+#include <atomic>
+#include <algorithm>
 
 #ifdef WIN32
 #include <ppl.h>
@@ -15,6 +20,7 @@
 #include "Hunk.h"
 #include "CoffObjectLoader.h"
 #include "CoffLibraryLoader.h"
+#include "LibraryCache.h"
 #include "ImportHandler.h"
 #include "Log.h"
 #include "HeuristicHunkSorter.h"
@@ -88,7 +94,9 @@ Crinkler::Crinkler():
 	m_reuseType(REUSE_OFF),
 	m_useSafeImporting(true),
 	m_hashtries(0),
+	m_hashShortlist(0),
 	m_hunktries(0),
+	m_hunkSearch(HUNK_SEARCH_HILLCLIMB),
 	m_printFlags(0),
 	m_showProgressBar(false),
 	m_useTinyHeader(false),
@@ -104,14 +112,16 @@ Crinkler::Crinkler():
 	m_saturate(0),
 	m_stripExports(false)
 {
-	InitCompressor();
-
 	m_modellist1 = InstantModels4k();
 	m_modellist2 = InstantModels4k();
 }
 
 
 Crinkler::~Crinkler() {
+	for(LazyLibrary* library : m_libraries)
+		delete library;
+	for(MemoryFile* file : m_inputFiles)
+		delete file;
 }
 
 void Crinkler::ReplaceDlls(HunkList& hunklist) {
@@ -144,13 +154,69 @@ void Crinkler::OverrideAlignments(HunkList& hunklist) {
 	}
 }
 
-void Crinkler::Load(const char* filename) {
-	HunkList* hunkList = m_hunkLoader.LoadFromFile(filename);
-	if(hunkList) {
-		m_hunkPool.Append(hunkList);
-		delete hunkList;
-	} else {
-		Log::Error(filename, "Unsupported file type");
+void Crinkler::Load(const vector<string>& filenames) {
+	// Map and parse the files concurrently. Library members are loaded when one of
+	// their symbols is needed, so libraries are only indexed here. Errors exit the
+	// process, so files that cannot be opened or loaded are reported afterwards.
+	int numFiles = (int)filenames.size();
+	vector<MemoryFile*> files(numFiles);
+	vector<HunkList*> hunklists(numFiles, nullptr);
+	vector<LazyLibrary*> libraries(numFiles, nullptr);
+	vector<CoffLibrary*> uncachedLibraries(numFiles, nullptr);
+	vector<unsigned long long> libraryHashes(numFiles, 0);
+	bool useLibraryCache = !m_libraryCacheDirectory.empty();
+	LibraryCache libraryCache(m_libraryCacheDirectory.c_str(), CRINKLER_TITLE);
+	concurrency::parallel_for(0, numFiles, [&](int i) {
+		const char* filename = filenames[i].c_str();
+		MemoryFile* file = new MemoryFile(filename, false, true);
+		files[i] = file;
+		if(file->GetPtr() == NULL)
+			return;
+		if(CoffLibraryLoader().Clicks(file->GetPtr(), file->GetSize())) {
+			LazyLibrary* library = nullptr;
+			if(useLibraryCache) {
+				libraryHashes[i] = LibraryCache::HashLibrary(file->GetPtr(), file->GetSize());
+				library = libraryCache.Open(filename, file->GetSize(), libraryHashes[i]);
+			}
+			if(library) {
+				// Hunks reference the cache file instead
+				delete file;
+				files[i] = nullptr;
+			} else {
+				CoffLibrary* coffLibrary = new CoffLibrary(file->GetPtr(), file->GetSize(), filename, file);
+				if(useLibraryCache) {
+					uncachedLibraries[i] = coffLibrary;
+				}
+				library = coffLibrary;
+			}
+			libraries[i] = library;
+		} else if(CoffObjectLoader().Clicks(file->GetPtr(), file->GetSize())) {
+			hunklists[i] = m_hunkLoader.Load(file->GetPtr(), file->GetSize(), filename);
+		}
+	});
+
+	// Add the hunks in command line order
+	for(int i = 0; i < numFiles; i++) {
+		if(!libraries[i] && !hunklists[i]) {
+			if(files[i]->GetPtr() == NULL)
+				Log::Error("", "Cannot open file '%s'", filenames[i].c_str());
+
+			// Loaders that do not support the file report it
+			hunklists[i] = m_hunkLoader.Load(files[i]->GetPtr(), files[i]->GetSize(), filenames[i].c_str());
+		}
+		if(libraries[i]) {
+			m_libraries.push_back(libraries[i]);
+			m_libraryPositions.push_back(m_hunkPool.GetNumHunks());
+			if(uncachedLibraries[i])
+				m_uncachedLibraries.push_back(make_pair(uncachedLibraries[i], libraryHashes[i]));
+		} else if(hunklists[i]) {
+			// Hunks reference the file until they are modified
+			m_inputFiles.push_back(files[i]);
+			m_hunkPool.Append(hunklists[i]);
+			delete hunklists[i];
+		} else {
+			Log::Error(filenames[i].c_str(), "Unsupported file type");
+		}
 	}
 }
 
@@ -179,6 +245,156 @@ void Crinkler::AddRuntimeLibrary() {
 	delete hunklist;
 }
 
+void Crinkler::LoadLibraryMembers() {
+	if(m_libraries.empty())
+		return;
+
+	// Names to resolve, each visited once
+	deque<PooledString> pending;
+	unordered_set<PooledString, PooledString::Hash> visited;
+	auto require = [&](const PooledString& name) {
+		if(visited.insert(name).second)
+			pending.push_back(name);
+	};
+
+	// Symbols needed besides those referenced by relocations
+	string entryName = GetEntrySymbolName();
+	if(m_hunkPool.FindUndecoratedSymbol(entryName.c_str()) == NULL) {
+		for(LazyLibrary* library : m_libraries) {
+			PooledString name;
+			if(library->FindUndecoratedSymbol(entryName.c_str(), name)) {
+				require(name);
+				break;
+			}
+		}
+	}
+	for(const Export& e : m_exports) {
+		if(!e.HasValue())
+			require(e.GetSymbol());
+	}
+	require("__imp__LoadLibraryA@4");
+	if(m_useSafeImporting && !m_useTinyImport)
+		require("__imp__MessageBoxA@16");
+
+	// Load members until all referenced symbols are resolved. A symbol that is only
+	// defined weakly is still searched for, as a full load would have found it. This
+	// includes the libraries after one whose member turned out to define it weakly.
+	// Each round claims the members for all pending names and parses them concurrently.
+	struct Claim {
+		int		library;
+		int		symbol;
+	};
+	const HunkList& pool = m_hunkPool;
+	int numInitialHunks = pool.GetNumHunks();
+	vector<vector<pair<int, Hunk*>>> loaded(m_libraries.size());
+	int numScanned = 0;
+
+	// First library not yet searched for each name
+	unordered_map<PooledString, int, PooledString::Hash> searchFrom;
+
+	// Number of libraries placed before each hunk, once the loaded hunks are moved to their library
+	unordered_map<Hunk*, int> librariesBefore;
+	for(int i = 0; i < numInitialHunks; i++) {
+		librariesBefore[pool[i]] = int(upper_bound(m_libraryPositions.begin(), m_libraryPositions.end(), i) - m_libraryPositions.begin());
+	}
+
+	// A full load would run the initializers of all members, so their members are roots
+	vector<Claim> claims;
+	if(m_runInitializers) {
+		for(int i = 0; i < (int)m_libraries.size(); i++) {
+			vector<int> symbols;
+			m_libraries[i]->ClaimInitializers(symbols);
+			for(int symbol : symbols)
+				claims.push_back(Claim { i, symbol });
+		}
+	}
+	while(true) {
+		for(; numScanned < pool.GetNumHunks(); numScanned++) {
+			Hunk* hunk = pool[numScanned];
+			for(int i = 0; i < hunk->GetNumRelocations(); i++) {
+				require(hunk->GetRelocations()[i].symbolname);
+			}
+		}
+		if(pending.empty() && claims.empty())
+			break;
+
+		vector<PooledString> claimedNames;
+		for(; !pending.empty(); pending.pop_front()) {
+			PooledString name = pending.front();
+			Symbol* s = m_hunkPool.FindSymbol(name);
+
+			// A strong definition only hides the libraries after it. Members defining the
+			// symbol in an earlier library are loaded, and list order decides which wins.
+			bool claimed = false;
+			int& first = searchFrom[name];
+			for(int i = first; i < (int)m_libraries.size() && !claimed; i++) {
+				if(s && s->secondaryName.empty() && librariesBefore[s->hunk] <= i)
+					break;
+				int symbol;
+				if(m_libraries[i]->ClaimSymbol(name, symbol)) {
+					claimed = true;
+					first = i + 1;
+					claimedNames.push_back(name);
+					if(symbol != -1)
+						claims.push_back(Claim { i, symbol });
+				}
+			}
+			if(!claimed && s && !s->secondaryName.empty())
+				require(s->secondaryName);
+		}
+
+		vector<HunkList*> members(claims.size());
+		vector<int> orders(claims.size());
+		concurrency::parallel_for(0, (int)claims.size(), [&](int c) {
+			members[c] = m_libraries[claims[c].library]->LoadSymbol(claims[c].symbol, &orders[c]);
+		});
+
+		// Add the hunks in claim order, so the result does not depend on the thread count
+		for(int c = 0; c < (int)claims.size(); c++) {
+			for(int h = 0; h < members[c]->GetNumHunks(); h++) {
+				loaded[claims[c].library].push_back(make_pair(orders[c], (*members[c])[h]));
+				librariesBefore[(*members[c])[h]] = claims[c].library + 1;
+			}
+			m_hunkPool.Append(members[c]);
+			delete members[c];
+		}
+		claims.clear();
+
+		// Search the remaining libraries for names still only defined weakly.
+		// The weak default is required once no library defines the name.
+		for(const PooledString& name : claimedNames) {
+			Symbol* s = m_hunkPool.FindSymbol(name);
+			if(s && !s->secondaryName.empty())
+				pending.push_back(name);
+		}
+	}
+
+	// Place the loaded hunks where their library was given, in the order of a full load
+	vector<Hunk*> order;
+	int next = 0;
+	for(int i = 0; i < (int)m_libraries.size(); i++) {
+		for(; next < m_libraryPositions[i]; next++)
+			order.push_back(pool[next]);
+		stable_sort(loaded[i].begin(), loaded[i].end(), [](const pair<int, Hunk*>& a, const pair<int, Hunk*>& b) { return a.first < b.first; });
+		for(const auto& p : loaded[i])
+			order.push_back(p.second);
+	}
+	for(; next < numInitialHunks; next++)
+		order.push_back(pool[next]);
+	assert((int)order.size() == pool.GetNumHunks());
+	for(int i = 0; i < (int)order.size(); i++)
+		m_hunkPool.SetHunk(i, order[i]);
+}
+
+void Crinkler::WriteLibraryCache() {
+	// Done after linking, as caching a library loads all of its members
+	LibraryCache libraryCache(m_libraryCacheDirectory.c_str(), CRINKLER_TITLE);
+	concurrency::parallel_for(0, (int)m_uncachedLibraries.size(), [&](int i) {
+		libraryCache.Write(*m_uncachedLibraries[i].first, m_uncachedLibraries[i].second);
+	});
+	m_uncachedLibraries.clear();
+}
+
 std::string Crinkler::GetEntrySymbolName() const {
 	if(m_entry.empty()) {
 		switch(m_subsystem) {
@@ -311,7 +527,7 @@ int Crinkler::OptimizeHashsize(unsigned char* data, int datasize, int hashsize,
 	hashbits[0] = ComputeHashBits(data, splittingPoint, context, m_modellist1, true, false);
 	hashbits[1] = ComputeHashBits(data + splittingPoint, datasize - splittingPoint, context, m_modellist2, false, true);
 
-	uint32_t* hashsizes = new uint32_t[tries];
+	int* hashsizes = new int[tries];
 	for (int i = 0; i < tries; i++) {
 		hashsize = PreviousPrime(hashsize / 2) * 2;
 		hashsizes[i] = hashsize;
@@ -319,17 +535,55 @@ int Crinkler::OptimizeHashsize(unsigned char* data, int datasize, int hashsize,
 
 	int* sizes = new int[tries];
 
-	int progress = 0;
-	concurrency::combinable<vector<unsigned char>> buffers([maxsize]() { return vector<unsigned char>(maxsize, 0); });
-	concurrency::combinable<vector<TinyHashEntry>> hashtable1([&hashbits]() { return vector<TinyHashEntry>(hashbits[0].tinyhashsize); });
-	concurrency::combinable<vector<TinyHashEntry>> hashtable2([&hashbits]() { return vector<TinyHashEntry>(hashbits[1].tinyhashsize); });
+	// Predict the collisions of every hash size. The best candidates go first, so the running
+	// best size becomes tight early. With a shortlist, only the most promising ones are compressed.
+	vector<long long> collisions(tries);
+	PredictHashCollisions4k(hashbits, 2, hashsizes, tries, collisions.data());
+	vector<int> order(tries);
+	for (int i = 0; i < tries; i++) {
+		order[i] = i;
+		sizes[i] = INT_MAX;
+	}
+	std::stable_sort(order.begin(), order.end(), [&collisions](int a, int b) { return collisions[a] < collisions[b]; });
+	int evaluated = m_hashShortlist > 0 ? min(tries, m_hashShortlist) : tries;
+
+	// Neighboring hash sizes are simulated together in one pass over the hash bits
+	int numBatches = (evaluated + MAX_HASHSIZE_BATCH - 1) / MAX_HASHSIZE_BATCH;
+	unsigned int tinyhashsize = max(hashbits[0].tinyhashsize, hashbits[1].tinyhashsize);
+
+	// Trials give up as soon as they are known to be worse than the best size found so far
+	std::atomic<int> runningBest(INT_MAX);
+	std::atomic<int> nextBatch(0);
+
+	int progress = tries - evaluated;
+	m_progressBar.Update(progress, m_hashtries);
+	concurrency::combinable<vector<unsigned char>> buffers([maxsize]() { return vector<unsigned char>(maxsize * MAX_HASHSIZE_BATCH, 0); });
+	concurrency::combinable<vector<TinyHashEntry>> hashtables([tinyhashsize]() { return vector<TinyHashEntry>(tinyhashsize * MAX_HASHSIZE_BATCH); });
 	concurrency::critical_section cs;
-	concurrency::parallel_for(0, tries, [&](int i) {
-		TinyHashEntry* hashtables[] = { hashtable1.local().data(), hashtable2.local().data() };
-		sizes[i] = CompressFromHashBits4k(hashbits, hashtables, 2, buffers.local().data(), maxsize, m_saturate != 0, CRINKLER_BASEPROB, hashsizes[i], nullptr);
+	concurrency::parallel_for(0, numBatches, [&](int) {
+		// Hand out batches in order regardless of how the iterations are partitioned
+		int first = nextBatch++ * MAX_HASHSIZE_BATCH;
+		int count = min(evaluated - first, MAX_HASHSIZE_BATCH);
+		unsigned char* outputs[MAX_HASHSIZE_BATCH];
+		TinyHashEntry* tables[MAX_HASHSIZE_BATCH];
+		int batchHashsizes[MAX_HASHSIZE_BATCH];
+		int batchSizes[MAX_HASHSIZE_BATCH];
+		for (int i = 0; i < count; i++) {
+			outputs[i] = buffers.local().data() + i * maxsize;
+			tables[i] = hashtables.local().data() + i * tinyhashsize;
+			batchHashsizes[i] = hashsizes[order[first + i]];
+		}
+		CompressFromHashBitsBatch4k(hashbits, tables, 2, outputs, maxsize, m_saturate != 0, CRINKLER_BASEPROB, batchHashsizes, count, batchSizes, &runningBest);
+
+		for (int i = 0; i < count; i++) {
+			sizes[order[first + i]] = batchSizes[i];
+			int best = runningBest;
+			while (batchSizes[i] < best && !runningBest.compare_exchange_weak(best, batchSizes[i]));
+		}
 
 		Concurrency::critical_section::scoped_lock l(cs);
-		m_progressBar.Update(++progress, m_hashtries);
+		progress += count;
+		m_progressBar.Update(progress, m_hashtries);
 	});
 
 	for (int i = 0; i < tries; i++) {
@@ -1107,6 +1361,8 @@ void Crinkler::Recompress(const char* input_filename, const char* output_filenam
 #endif
 }
 
+// Initializers are collected from the object files and the library members that were loaded.
+// LoadLibraryMembers loads all library members with initializers, as a full load would.
 Hunk* Crinkler::CreateDynamicInitializerHunk()
 {
 	const int num_hunks = m_hunkPool.GetNumHunks();
@@ -1120,7 +1376,7 @@ Hunk* Crinkler::CreateDynamicInitializerHunk()
 			Relocation* relocations = hunk->GetRelocations();
 			for(int i = 0; i < num_relocations; i++)
 			{
-				symbols.push_back(m_hunkPool.FindSymbol(relocations[i].symbolname.c_str()));
+				symbols.push_back(m_hunkPool.FindSymbol(relocations[i].symbolname));
 			}
 		}
 	}
@@ -1169,6 +1425,9 @@ void Crinkler::Link(const char* filename) {
 	}
 
 
+	// Load the library members that are needed
+	LoadLibraryMembers();
+
 	// Find entry hunk and move it to front
 	Symbol* entry = FindEntryPoint();
 	if(entry == NULL)
@@ -1277,6 +1536,11 @@ void Crinkler::Link(const char* filename) {
 	// Sort hunks heuristically
 	HeuristicHunkSorter::SortHunkList(&m_hunkPool);
 
+	// Give the empirical sorter a starting point with related sections next to each other
+	if (m_hunktries > 0 && (m_useTinyHeader || m_compressionType != COMPRESSION_INSTANT)) {
+		HeuristicHunkSorter::OrderByAffinity(&m_hunkPool);
+	}
+
 	int best_hashsize = PreviousPrime(m_hashsize / 2) * 2;
 
 	Reuse *reuse = nullptr;
@@ -1300,7 +1564,8 @@ void Crinkler::Link(const char* filename) {
 
 	if (!m_transform->LinkAndTransform(&m_hunkPool, importSymbol, CRINKLER_CODEBASE, phase1, &phase1Untransformed, &splittingPoint, true))
 	{
-		// Transform failed, run again
+		// Transform failed, run again without it
+		m_transform->Disable();
 		delete phase1;
 		delete phase1Untransformed;
 		m_transform->LinkAndTransform(&m_hunkPool, importSymbol, CRINKLER_CODEBASE, phase1, &phase1Untransformed, &splittingPoint, false);
@@ -1347,7 +1612,7 @@ void Crinkler::Link(const char* filename) {
 			if (m_hunktries > 0)
 			{
 				int target_size1, target_size2;
-				EmpiricalHunkSorter::SortHunkList(&m_hunkPool, *m_transform, m_modellist1, m_modellist2, m_modellist1k, CRINKLER_BASEPROB, m_saturate != 0, m_hunktries,
+				EmpiricalHunkSorter::SortHunkList(&m_hunkPool, *m_transform, m_modellist1, m_modellist2, m_modellist1k, CRINKLER_BASEPROB, m_saturate != 0, m_hunktries, m_hunkSearch,
 #ifdef WIN32
 						m_showProgressBar ? &m_windowBar :
 #endif
@@ -1355,7 +1620,14 @@ void Crinkler::Link(const char* filename) {
 						m_useTinyHeader, &target_size1, &target_size2);
 				delete phase1;
 				delete phase1Untransformed;
-				m_transform->LinkAndTransform(&m_hunkPool, importSymbol, CRINKLER_CODEBASE, phase1, &phase1Untransformed, &splittingPoint, true);
+				if (!m_transform->LinkAndTransform(&m_hunkPool, importSymbol, CRINKLER_CODEBASE, phase1, &phase1Untransformed, &splittingPoint, true) && m_transform->IsEnabled())
+				{
+					// The transform does not apply to the new order
+					m_transform->Disable();
+					delete phase1;
+					delete phase1Untransformed;
+					m_transform->LinkAndTransform(&m_hunkPool, importSymbol, CRINKLER_CODEBASE, phase1, &phase1Untransformed, &splittingPoint, false);
+				}
 
 				idealsize = EstimateModels((unsigned char*)phase1->GetPtr(), phase1->GetRawSize(), splittingPoint, true, m_useTinyHeader, target_size1, target_size2);
 			}
@@ -1442,6 +1714,8 @@ void Crinkler::Link(const char* filename) {
 		Log::Error(filename, "Output file too big. Crinkler does not support final file sizes of more than 128k.");
 	}
 
+	WriteLibraryCache();
+
 	if (reuse) delete reuse;
 	delete phase1;
 	delete phase1Untransformed;
@@ -1505,8 +1779,14 @@ void Crinkler::PrintOptions(FILE *out) {
 		if(!m_useTinyHeader)
 		{
 			fprintf(out, " /HASHTRIES:%d", m_hashtries);
+			if (m_hashShortlist > 0) {
+				fprintf(out, " /HASHSHORTLIST:%d", m_hashShortlist);
+			}
 		}
 		fprintf(out, " /ORDERTRIES:%d", m_hunktries);
+		if (m_hunkSearch != HUNK_SEARCH_HILLCLIMB) {
+			fprintf(out, " /ORDERSEARCH:%s", HunkSearchTypeName(m_hunkSearch));
+		}
 	}
 	for(int i = 0; i < (int)m_rangeDlls.size(); i++) {
 		fprintf(out, " /RANGE:%s", m_rangeDlls[i].c_str());
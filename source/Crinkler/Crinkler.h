@@ -19,9 +19,13 @@
 #include "CompositeProgressBar.h"
 #include "Export.h"
 #include "Reuse.h"
+#include "EmpiricalHunkSorter.h"
 
 
 class HunkLoader;
+class LazyLibrary;
+class CoffLibrary;
+class MemoryFile;
 
 static const int CRINKLER_IMAGEBASE =	0x400000;
 static const int CRINKLER_SECTIONSIZE = 0x10000;
@@ -42,13 +46,20 @@ static const int CRINKLER_LINKER_VERSION = 0x3332;
 class Crinkler {
 	MultiLoader							m_hunkLoader;
 	HunkList							m_hunkPool;
+	std::vector<LazyLibrary*>			m_libraries;		// Libraries with members not loaded yet
+	std::vector<int>					m_libraryPositions;	// Position in the hunk pool of each library
+	std::vector<MemoryFile*>			m_inputFiles;		// Object files referenced by loaded hunks
 	std::string							m_entry;
 	std::string							m_summaryFilename;
 	std::string							m_reuseFilename;
+	std::string							m_libraryCacheDirectory;
+	std::vector<std::pair<const CoffLibrary*, unsigned long long>>	m_uncachedLibraries;	// Libraries missing from the cache, with their hash
 	SubsystemType						m_subsystem;
 	int									m_hashsize;
 	int									m_hashtries;
+	int									m_hashShortlist;	// Hash sizes with the fewest predicted collisions that are compressed, or 0 for all
 	int									m_hunktries;
+	HunkSearchType						m_hunkSearch;
 	int									m_printFlags;
 	bool								m_useSafeImporting;
 	CompressionType						m_compressionType;
@@ -80,6 +91,8 @@ class Crinkler {
 #endif
 	CompositeProgressBar				m_progressBar;
 
+	void LoadLibraryMembers();
+	void WriteLibraryCache();
 	Symbol*	FindEntryPoint();
 	void RemoveUnreferencedHunks(Hunk* base);
 	std::string GetEntrySymbolName() const;
@@ -103,7 +116,7 @@ public:
 	Crinkler();
 	~Crinkler();
 
-	void Load(const char* filename);
+	void Load(const std::vector<std::string>& filenames);
 	void Load(const char* data, int size, const char* module);
 	void AddRuntimeLibrary();
 	void Recompress(const char* input_filename, const char* output_filename);
@@ -129,12 +142,15 @@ public:
 	void SetCompressionType(CompressionType compressionType){ m_compressionType = compressionType; }
 	void SetHashsize(int hashsize)							{ m_hashsize = hashsize*1024*1024; }
 	void SetHashtries(int hashtries)						{ m_hashtries = hashtries; }
+	void SetHashShortlist(int shortlist)					{ m_hashShortlist = shortlist; }
 	void SetHunktries(int hunktries)						{ m_hunktries = hunktries; }
+	void SetHunkSearch(HunkSearchType hunkSearch)			{ m_hunkSearch = hunkSearch; }
 	void SetSaturate(int saturate)							{ m_saturate = saturate; }
 	
 	void SetImportingType(bool safe)						{ m_useSafeImporting = safe; }
 	void SetSummary(const char* summaryFilename)			{ m_summaryFilename = summaryFilename; }
 	void SetReuse(ReuseType type, const char* filename)		{ m_reuseType = type;	m_reuseFilename = filename; }
+	void SetLibraryCache(const char* directory)				{ m_libraryCacheDirectory = directory; }
 	void SetTruncateFloats(bool enabled)					{ m_truncateFloats = enabled; }
 	void SetTruncateBits(int bits)							{ m_truncateBits = bits; }
 	void SetOverrideAlignments(bool enabled)				{ m_overrideAlignments = enabled; }
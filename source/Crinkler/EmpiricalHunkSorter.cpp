@@ -1,17 +1,181 @@
 #include "EmpiricalHunkSorter.h"
+#include <algorithm>
 #include <ctime>
 #include <cmath>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <vector>
 #include <ppl.h>
 #include "HunkList.h"
 #include "Hunk.h"
+#include "HeuristicHunkSorter.h"
+#include "IncrementalLinker.h"
 #include "../Compressor/CompressionStream.h"
 #include "ProgressBar.h"
 #include "Crinkler.h"
 
 using namespace std;
 
-static void PermuteHunklist(HunkList* hunklist, int strength) {
-	int n_permutes = (rand() % strength) + 1;
+// Number of permutations generated and evaluated concurrently per round.
+// Fixed, so the search does not depend on the number of threads.
+static const int CANDIDATES_PER_ROUND = 16;
+
+// Annealing and tabu search run this many independent chains, which share the candidates of a round
+static const int SEARCH_CHAINS = 4;
+
+// Chains that are worse than the best order found are restarted from it this often (in rounds)
+static const int SEARCH_EXCHANGE_ROUNDS = 16;
+
+// Annealing temperatures at the start and end of the search, in bytes
+static const double ANNEAL_START_TEMPERATURE = 2.0;
+static const double ANNEAL_END_TEMPERATURE = 1.0 / 64;
+
+// Number of recently visited orders that tabu search will not return to
+static const int TABU_LENGTH = 64;
+
+// Number of hunks with similar content a hunk can be moved next to
+static const int SIMILAR_HUNKS = 4;
+
+// Biases the moves of PermuteHunklist. Only read while candidates are generated.
+struct MoveGuide {
+	unordered_map<const Hunk*, int>				costs;		// Compressed cost per byte of hunks in the best order
+	unordered_map<const Hunk*, vector<Hunk*>>	similar;	// Hunks with the most similar content
+};
+
+// Decides which candidate a search chain moves to in each round
+class HunkSearchStrategy {
+public:
+	virtual ~HunkSearchStrategy() {}
+
+	// Returns the chosen candidate, or -1 to stay at the current order.
+	// progress goes from 0 to 1 over the search.
+	virtual int		Select(const int* sizes, const unsigned long long* hashes, const vector<int>& candidates, int currentSize, int bestSize, double progress, minstd_rand& rng) = 0;
+
+	// Called when the chain moves to the order with the given hash
+	virtual void	Visit(unsigned long long hash) {}
+};
+
+static int SmallestCandidate(const int* sizes, const vector<int>& candidates) {
+	int best = -1;
+	for(int c : candidates) {
+		if(best == -1 || sizes[c] < sizes[best])
+			best = c;
+	}
+	return best;
+}
+
+// Accept only strict improvements
+class HillClimbStrategy : public HunkSearchStrategy {
+public:
+	int Select(const int* sizes, const unsigned long long* hashes, const vector<int>& candidates, int currentSize, int bestSize, double progress, minstd_rand& rng) {
+		int best = SmallestCandidate(sizes, candidates);
+		return best != -1 && sizes[best] < currentSize ? best : -1;
+	}
+};
+
+// Accept worse orders with a probability that decreases with the loss and over time
+class AnnealingStrategy : public HunkSearchStrategy {
+public:
+	int Select(const int* sizes, const unsigned long long* hashes, const vector<int>& candidates, int currentSize, int bestSize, double progress, minstd_rand& rng) {
+		int best = SmallestCandidate(sizes, candidates);
+		if(best == -1 || sizes[best] < currentSize)
+			return best;
+
+		double temperature = ANNEAL_START_TEMPERATURE * pow(ANNEAL_END_TEMPERATURE / ANNEAL_START_TEMPERATURE, progress) * (BIT_PRECISION * 8);
+		double probability = exp((currentSize - sizes[best]) / temperature);
+		double r = (rng() - minstd_rand::min()) / double(minstd_rand::max() - minstd_rand::min());
+		return r < probability ? best : -1;
+	}
+};
+
+// Always move to the best candidate not recently visited, unless it is a new best
+class TabuStrategy : public HunkSearchStrategy {
+	deque<unsigned long long> m_recent;
+
+	bool IsTabu(unsigned long long hash) const {
+		return find(m_recent.begin(), m_recent.end(), hash) != m_recent.end();
+	}
+public:
+	int Select(const int* sizes, const unsigned long long* hashes, const vector<int>& candidates, int currentSize, int bestSize, double progress, minstd_rand& rng) {
+		int best = -1;
+		for(int c : candidates) {
+			if(IsTabu(hashes[c]) && sizes[c] >= bestSize)
+				continue;
+			if(best == -1 || sizes[c] < sizes[best])
+				best = c;
+		}
+		return best;
+	}
+
+	void Visit(unsigned long long hash) {
+		m_recent.push_back(hash);
+		if((int)m_recent.size() > TABU_LENGTH)
+			m_recent.pop_front();
+	}
+};
+
+static HunkSearchStrategy* CreateSearchStrategy(HunkSearchType type) {
+	switch(type) {
+		case HUNK_SEARCH_ANNEAL:
+			return new AnnealingStrategy();
+		case HUNK_SEARCH_TABU:
+			return new TabuStrategy();
+		default:
+			return new HillClimbStrategy();
+	}
+}
+
+// Pick a block start with probability proportional to the compressed cost per byte of its first hunk.
+// Hunks without a known cost, e.g. uninitialized ones, get an average weight.
+static int PickExpensiveHunk(HunkList* hunklist, int base, int count, const MoveGuide& guide, minstd_rand& rng) {
+	vector<unsigned int> weights(count);
+	unsigned int total = 0;
+	for(int i = 0; i < count; i++) {
+		auto it = guide.costs.find((*hunklist)[base + i]);
+		weights[i] = (it != guide.costs.end() ? it->second : BIT_PRECISION * 4) + 1;
+		total += weights[i];
+	}
+
+	unsigned int r = rng() % total;
+	int i = 0;
+	while(r >= weights[i]) {
+		r -= weights[i];
+		i++;
+	}
+	return i;
+}
+
+// Pick a destination that puts the block at h1i right next to a hunk with similar content.
+// Returns -1 if there is none.
+static int PickSimilarDestination(HunkList* hunklist, int base, int count, int h1i, int n, const MoveGuide& guide, minstd_rand& rng) {
+	auto it = guide.similar.find((*hunklist)[base + h1i]);
+	if(it == guide.similar.end() || it->second.empty())
+		return -1;
+	Hunk* partner = it->second[rng() % it->second.size()];
+	bool before = rng() % 2;
+
+	int q = 0;
+	while(q < count && (*hunklist)[base + q] != partner)
+		q++;
+	if(q == count || (q >= h1i && q < h1i + n))
+		return -1;
+
+	// Position of the block after the move, so it ends up right after or before the partner
+	int h2i;
+	if(q < h1i)
+		h2i = before ? q : q + 1;
+	else
+		h2i = before ? q - n : q - n + 1;
+	if(h2i < 0 || h2i > count - n || h2i == h1i)
+		return -1;
+	return h2i;
+}
+
+static void PermuteHunklist(HunkList* hunklist, int strength, minstd_rand& rng, const MoveGuide* guide) {
+	int n_permutes = (rng() % strength) + 1;
 	for (int p = 0 ; p < n_permutes ; p++)
 	{
 		int h1i, h2i;
@@ -39,17 +203,26 @@ static void PermuteHunklist(HunkList* hunklist, int strength) {
 
 		int s;
 		do {
-			s = rand() % 3;
+			s = rng() % 3;
 		} while (sections[s] < 2);
 		int max_n = sections[s]/2;
 		if (max_n > strength) max_n = strength;
-		int n = (rand() % max_n) + 1;
-		h1i = rand() % (sections[s] - n + 1);
-		do {
-			h2i = rand() % (sections[s] - n + 1);
-		} while (h2i == h1i);
+		int n = (rng() % max_n) + 1;
 		int base = (s > 0 ? sections[0] : 0) + (s > 1 ? sections[1] : 0);
 
+		// Half of the moves are guided: expensive hunks are moved more often,
+		// and preferably next to hunks with similar content.
+		if (guide && rng() % 2)
+			h1i = PickExpensiveHunk(hunklist, base, sections[s] - n + 1, *guide, rng);
+		else
+			h1i = rng() % (sections[s] - n + 1);
+		h2i = (guide && rng() % 2) ? PickSimilarDestination(hunklist, base, sections[s], h1i, n, *guide, rng) : -1;
+		if (h2i == -1) {
+			do {
+				h2i = rng() % (sections[s] - n + 1);
+			} while (h2i == h1i);
+		}
+
 		if (h2i < h1i)
 		{
 			// Insert before
@@ -67,147 +240,313 @@ static void PermuteHunklist(HunkList* hunklist, int strength) {
 	}
 }
 
+// Permute hunklist, keeping the leading (DLL) and trailing (export) hunks in place
+static void PermuteCandidate(HunkList* hunklist, minstd_rand& rng, const MoveGuide* guide) {
+	// Save DLL hunk
+	Hunk* dllhunk = nullptr;
+	int dlli;
+	for(dlli = 0; dlli < hunklist->GetNumHunks(); dlli++) {
+		if((*hunklist)[dlli]->GetFlags() & HUNK_IS_LEADING) {
+			dllhunk = (*hunklist)[dlli];
+			hunklist->RemoveHunk(dllhunk);
+			break;
+		}
+	}
+
+	Hunk* eh = nullptr;
+	int ehi;
+	for (ehi = 0; ehi < hunklist->GetNumHunks(); ehi++) {
+		if ((*hunklist)[ehi]->GetFlags() & HUNK_IS_TRAILING) {
+			eh = (*hunklist)[ehi];
+			hunklist->RemoveHunk(eh);
+			break;
+		}
+	}
+
+	PermuteHunklist(hunklist, 2, rng, guide);
+
+	// Restore export hunk, if present
+	if (eh) {
+		hunklist->InsertHunk(ehi, eh);
+	}
+
+	if(dllhunk)
+	{
+		hunklist->InsertHunk(dlli, dllhunk);
+	}
+}
+
 EmpiricalHunkSorter::EmpiricalHunkSorter() {
 }
 
 EmpiricalHunkSorter::~EmpiricalHunkSorter() {
 }
 
-int EmpiricalHunkSorter::TryHunkCombination(HunkList* hunklist, Transform& transform, ModelList4k& codeModels, ModelList4k& dataModels, ModelList1k& models1k, int baseprob, bool saturate, bool use1KMode, int* out_size1, int* out_size2)
+// Segments are compressed independently, so a segment that is identical to the reference
+// segment, including the context preceding it, has the same compressed size.
+static bool SegmentUnchanged(const vector<unsigned char>& reference, const vector<unsigned char>& data, int offset, int size) {
+	int start = max(offset - MAX_CONTEXT_LENGTH, 0);
+	return memcmp(reference.data() + start, data.data() + start, offset + size - start) == 0;
+}
+
+int EmpiricalHunkSorter::TryHunkCombination(HunkList* hunklist, Transform& transform, Symbol* import, const IncrementalLinker* linker, ModelList4k& codeModels, ModelList4k& dataModels, ModelList1k& models1k, int baseprob, bool saturate, bool use1KMode, const LinkedImage* reference, LinkedImage& result)
 {
 	int splittingPoint;
 
-	Hunk* phase1;
-	Symbol* import = hunklist->FindSymbol("_Import");
-	transform.LinkAndTransform(hunklist, import, CRINKLER_CODEBASE, phase1, NULL, &splittingPoint, false);
+	Hunk* phase1 = linker ? linker->Link(hunklist, &splittingPoint) : nullptr;
+	if (!phase1)
+	{
+		transform.LinkAndTransform(hunklist, import, CRINKLER_CODEBASE, phase1, NULL, &splittingPoint, false);
+	}
+
+	const unsigned char* data = (const unsigned char*)phase1->GetPtr();
+	int size = phase1->GetRawSize();
+	result.data.assign(data, data + size);
+	result.splittingPoint = splittingPoint;
+	delete phase1;
 
-	int totalsize = 0;
 	if (use1KMode)
 	{
-		int max_size = phase1->GetRawSize() * 2 + 1000;
-		unsigned char* compressed_data_ptr = new unsigned char[max_size];
-		Compress1k((unsigned char*)phase1->GetPtr(), phase1->GetRawSize(), compressed_data_ptr, max_size, models1k, nullptr, &totalsize);	//TODO: Estimate instead of compress
-		delete[] compressed_data_ptr;
-
-		if(out_size1) *out_size1 = totalsize;
-		if(out_size2) *out_size2 = 0;
+		if (reference && reference->data == result.data)
+			result.size1 = reference->size1;
+		else
+			result.size1 = EvaluateSize1k(result.data.data(), size, models1k);
+		result.size2 = 0;
 	}
 	else
 	{
-		ModelList4k* ModelLists[] = { &codeModels, &dataModels };
-		int sectionSizes[] = {splittingPoint, phase1->GetRawSize() - splittingPoint};
-		int compressedSizes[2] = {};
-		totalsize = EvaluateSize4k((unsigned char*)phase1->GetPtr(), 2, sectionSizes, compressedSizes, ModelLists, baseprob, saturate);
-		
-		if (out_size1) *out_size1 = compressedSizes[0];
-		if (out_size2) *out_size2 = compressedSizes[1];
+		// Only re-evaluate segments that differ from the reference
+		bool codeUnchanged = false;
+		bool dataUnchanged = false;
+		if (reference && splittingPoint >= 0 && reference->splittingPoint == splittingPoint)
+		{
+			codeUnchanged = SegmentUnchanged(reference->data, result.data, 0, splittingPoint);
+			dataUnchanged = reference->data.size() == result.data.size() && SegmentUnchanged(reference->data, result.data, splittingPoint, size - splittingPoint);
+		}
 
-		delete phase1;
+		if (!codeUnchanged && !dataUnchanged)
+		{
+			ModelList4k* ModelLists[] = { &codeModels, &dataModels };
+			int sectionSizes[] = {splittingPoint, size - splittingPoint};
+			int compressedSizes[2] = {};
+			EvaluateSize4k(result.data.data(), 2, sectionSizes, compressedSizes, ModelLists, baseprob, saturate);
+			result.size1 = compressedSizes[0];
+			result.size2 = compressedSizes[1];
+		}
+		else
+		{
+			result.size1 = codeUnchanged ? reference->size1 : EvaluateSegmentSize4k(result.data.data(), 0, splittingPoint, codeModels, baseprob, saturate, nullptr);
+			result.size2 = dataUnchanged ? reference->size2 : EvaluateSegmentSize4k(result.data.data(), splittingPoint, size - splittingPoint, dataModels, baseprob, saturate, nullptr);
+		}
 	}
 
-	return totalsize;
+	return result.size1 + result.size2;
 }
 
-int EmpiricalHunkSorter::SortHunkList(HunkList* hunklist, Transform& transform, ModelList4k& codeModels, ModelList4k& dataModels, ModelList1k& models1k, int baseprob, bool saturate, int numIterations, ProgressBar* progress, bool use1KMode, int* out_size1, int* out_size2)
+void EmpiricalHunkSorter::ComputeHunkCosts(const HunkList* hunklist, const IncrementalLinker* linker, const LinkedImage& image, ModelList4k& codeModels, ModelList4k& dataModels, int baseprob, bool saturate, unordered_map<const Hunk*, int>& costs)
 {
-	srand(1);
+	costs.clear();
+	int size = (int)image.data.size();
+	vector<int> offsets;
+	if (!linker || image.splittingPoint < 0 || image.splittingPoint > size || !linker->GetHunkOffsets(hunklist, offsets))
+		return;
+
+	vector<int> byteCosts(size);
+	EvaluateSegmentSize4k(image.data.data(), 0, image.splittingPoint, codeModels, baseprob, saturate, byteCosts.data());
+	EvaluateSegmentSize4k(image.data.data(), image.splittingPoint, size - image.splittingPoint, dataModels, baseprob, saturate, byteCosts.data() + image.splittingPoint);
 
+	for (int j = 0; j < hunklist->GetNumHunks(); j++)
+	{
+		const Hunk* hunk = (*hunklist)[j];
+		int start = offsets[j];
+		int end = min(start + hunk->GetRawSize(), size);	// The image is trimmed
+		if (end <= start)
+			continue;
+
+		long long cost = 0;
+		for (int pos = start; pos < end; pos++)
+			cost += byteCosts[pos];
+		costs[hunk] = int(cost / (end - start));
+	}
+}
+
+int EmpiricalHunkSorter::SortHunkList(HunkList* hunklist, Transform& transform, ModelList4k& codeModels, ModelList4k& dataModels, ModelList1k& models1k, int baseprob, bool saturate, int numIterations, HunkSearchType searchType, ProgressBar* progress, bool use1KMode, int* out_size1, int* out_size2)
+{
 	int nHunks = hunklist->GetNumHunks();
 	
 	printf("\n\nReordering sections...\n");
 	fflush(stdout);
 	
-	int best_size1;
-	int best_size2;
-	int best_total_size = TryHunkCombination(hunklist, transform, codeModels, dataModels, models1k, baseprob, saturate, use1KMode, &best_size1, &best_size2);
+	// The hunks are shared with the candidate lists, so the entry symbol is the same for all of them
+	Symbol* import = hunklist->FindSymbol("_Import");
+
+	LinkedImage best;
+	int best_total_size = TryHunkCombination(hunklist, transform, import, nullptr, codeModels, dataModels, models1k, baseprob, saturate, use1KMode, nullptr, best);
 	if(use1KMode)
 	{
 		printf("  Iteration: %5d  Size: %5.2f\n", 0, best_total_size / (BIT_PRECISION * 8.0f));
 	}
 	else
 	{
-		printf("  Iteration: %5d  Code: %.2f  Data: %.2f  Size: %.2f\n", 0, best_size1 / (BIT_PRECISION * 8.0f), best_size2 / (BIT_PRECISION * 8.0f), best_total_size / (BIT_PRECISION * 8.0f));
+		printf("  Iteration: %5d  Code: %.2f  Data: %.2f  Size: %.2f\n", 0, best.size1 / (BIT_PRECISION * 8.0f), best.size2 / (BIT_PRECISION * 8.0f), best_total_size / (BIT_PRECISION * 8.0f));
 	}
 	
 	if(progress)
 		progress->BeginTask("Reordering sections");
 
-	Hunk** backup = new Hunk*[nHunks];
-	int fails = 0;
-	int stime = clock();
-	for(int i = 1; i < numIterations; i++) {
-		for(int j = 0; j < nHunks; j++)
-			backup[j] = (*hunklist)[j];
-		
-		// Save DLL hunk
-		Hunk* dllhunk = nullptr;
-		int dlli;
-		for(dlli = 0; dlli < hunklist->GetNumHunks(); dlli++) {
-			if((*hunklist)[dlli]->GetFlags() & HUNK_IS_LEADING) {
-				dllhunk = (*hunklist)[dlli];
-				hunklist->RemoveHunk(dllhunk);
-				break;
-			}
-		}
-		
-
-		Hunk* eh = nullptr;
-		int ehi;
-		for (ehi = 0; ehi < hunklist->GetNumHunks(); ehi++) {
-			if ((*hunklist)[ehi]->GetFlags() & HUNK_IS_TRAILING) {
-				eh = (*hunklist)[ehi];
-				hunklist->RemoveHunk(eh);
-				break;
-			}
-		}
+	// Relink permutations incrementally from the current best order, if symbol resolution allows it
+	IncrementalLinker* linker = IncrementalLinker::Create(hunklist, transform, import, CRINKLER_CODEBASE);
 
-		PermuteHunklist(hunklist, 2);
-		
-		// Restore export hunk, if present
-		if (eh) {
-			hunklist->InsertHunk(ehi, eh);
+	// Guide moves by content similarity and by the compressed cost of hunks in the best order.
+	// Costs are only known in 4k mode with incremental linking.
+	MoveGuide guide;
+	HeuristicHunkSorter::FindSimilarHunks(hunklist, SIMILAR_HUNKS, guide.similar);
+	if(!use1KMode)
+		ComputeHunkCosts(hunklist, linker, best, codeModels, dataModels, baseprob, saturate, guide.costs);
+
+	// Orders are identified by a hash of the original hunk indices
+	unordered_map<const Hunk*, int> hunkIndex;
+	for(int j = 0; j < nHunks; j++)
+		hunkIndex[(*hunklist)[j]] = j;
+	auto hashOrder = [&hunkIndex](const vector<Hunk*>& order) {
+		unsigned long long hash = 14695981039346656037ull;
+		for(const Hunk* hunk : order) {
+			hash ^= (unsigned long long)hunkIndex.find(hunk)->second;
+			hash *= 1099511628211ull;
 		}
-		
-		if(dllhunk)
+		return hash;
+	};
+
+	// Each search chain walks from its own current order. Hill climbing uses a single chain,
+	// which always sits at the best order found.
+	struct SearchChain {
+		vector<Hunk*>						order;
+		unsigned long long					hash;
+		LinkedImage							image;
+		int									size;
+		unique_ptr<HunkSearchStrategy>		strategy;
+		minstd_rand							rng;
+	};
+	vector<Hunk*> bestOrder(nHunks);
+	for(int j = 0; j < nHunks; j++)
+		bestOrder[j] = (*hunklist)[j];
+
+	int numChains = searchType == HUNK_SEARCH_HILLCLIMB ? 1 : SEARCH_CHAINS;
+	vector<SearchChain> chains(numChains);
+	for(int k = 0; k < numChains; k++) {
+		SearchChain& chain = chains[k];
+		chain.order = bestOrder;
+		chain.hash = hashOrder(bestOrder);
+		chain.image = best;
+		chain.size = best_total_size;
+		chain.strategy.reset(CreateSearchStrategy(searchType));
+		chain.strategy->Visit(chain.hash);
+		chain.rng.seed(k + 1);
+	}
+
+	// Each round evaluates a batch of permutations in parallel, candidate c belonging to chain
+	// c % numChains. The permutation for each candidate is generated from a generator seeded with
+	// the round and candidate index, and chains make their choices in a fixed order, so the result
+	// only depends on the number of iterations, not on the thread count.
+	vector<vector<Hunk*>> candidates(CANDIDATES_PER_ROUND, vector<Hunk*>(nHunks));
+	vector<LinkedImage> results(CANDIDATES_PER_ROUND);
+	int sizes[CANDIDATES_PER_ROUND];
+	unsigned long long hashes[CANDIDATES_PER_ROUND];
+	int stime = clock();
+	for(int i = 1, round = 0; i < numIterations; i += CANDIDATES_PER_ROUND, round++) {
+		int numCandidates = min(CANDIDATES_PER_ROUND, numIterations - i);
+
+		concurrency::parallel_for(0, numCandidates, [&](int c)
 		{
-			hunklist->InsertHunk(dlli, dllhunk);
-		}
+			const SearchChain& chain = chains[c % numChains];
 
+			// Private list sharing the hunks of the main list
+			HunkList candidate;
+			for(Hunk* hunk : chain.order)
+				candidate.AddHunkBack(hunk);
 
-		int size1, size2;
-		int total_size = TryHunkCombination(hunklist, transform, codeModels, dataModels, models1k, baseprob, saturate, use1KMode, &size1, &size2);
-		if(total_size < best_total_size) {
-			if(use1KMode)
-			{
-				printf("  Iteration: %5d  Size: %5.2f\n", i, total_size / (BIT_PRECISION * 8.0f));
+			// Mix the seed, as nearby seeds give correlated sequences
+			seed_seq seed { round, c };
+			minstd_rand rng(seed);
+			PermuteCandidate(&candidate, rng, &guide);
+			sizes[c] = TryHunkCombination(&candidate, transform, import, linker, codeModels, dataModels, models1k, baseprob, saturate, use1KMode, &chain.image, results[c]);
+
+			for(int j = 0; j < nHunks; j++)
+				candidates[c][j] = candidate[j];
+			hashes[c] = hashOrder(candidates[c]);
+
+			// The hunks are owned by the main list
+			candidate.Clear();
+		});
+
+		double searchProgress = (double)i / numIterations;
+		int previousBestSize = best_total_size;
+		for(int k = 0; k < numChains; k++) {
+			SearchChain& chain = chains[k];
+			vector<int> chainCandidates;
+			for(int c = k; c < numCandidates; c += numChains)
+				chainCandidates.push_back(c);
+
+			int selected = chain.strategy->Select(sizes, hashes, chainCandidates, chain.size, best_total_size, searchProgress, chain.rng);
+			if(selected == -1)
+				continue;
+
+			chain.order = candidates[selected];
+			chain.hash = hashes[selected];
+			chain.size = sizes[selected];
+			swap(chain.image, results[selected]);
+			chain.strategy->Visit(chain.hash);
+
+			if(chain.size < best_total_size) {
+				if(use1KMode)
+				{
+					printf("  Iteration: %5d  Size: %5.2f\n", i + selected, chain.size / (BIT_PRECISION * 8.0f));
+				}
+				else
+				{
+					printf("  Iteration: %5d  Code: %.2f  Data: %.2f  Size: %.2f\n", i + selected, chain.image.size1 / (BIT_PRECISION * 8.0f), chain.image.size2 / (BIT_PRECISION * 8.0f), chain.size / (BIT_PRECISION * 8.0f));
+				}
+				fflush(stdout);
+
+				best_total_size = chain.size;
+				best = chain.image;
+				bestOrder = chain.order;
+
+				for(int j = 0; j < nHunks; j++)
+					hunklist->SetHunk(j, bestOrder[j]);
+				if(linker)
+					linker->SetBase(hunklist);
 			}
-			else
-			{
-				printf("  Iteration: %5d  Code: %.2f  Data: %.2f  Size: %.2f\n", i, size1 / (BIT_PRECISION * 8.0f), size2 / (BIT_PRECISION * 8.0f), total_size / (BIT_PRECISION * 8.0f));
+		}
+
+		if(best_total_size < previousBestSize && !use1KMode)
+			ComputeHunkCosts(hunklist, linker, best, codeModels, dataModels, baseprob, saturate, guide.costs);
+
+		// Restart chains that lag behind from the best order
+		if(numChains > 1 && (round + 1) % SEARCH_EXCHANGE_ROUNDS == 0) {
+			for(SearchChain& chain : chains) {
+				if(chain.size > best_total_size) {
+					chain.order = bestOrder;
+					chain.hash = hashOrder(bestOrder);
+					chain.image = best;
+					chain.size = best_total_size;
+					chain.strategy->Visit(chain.hash);
+				}
 			}
-			
-			fflush(stdout);
-			best_total_size = total_size;
-			best_size1 = size1;
-			best_size2 = size2;
-			fails = 0;
-		} else {
-			fails++;
-			// Restore from backup
-			for(int j = 0; j < nHunks; j++)
-				(*hunklist)[j] = backup[j];
 		}
+
 		if(progress)
-			progress->Update(i+1, numIterations);
+			progress->Update(i+numCandidates, numIterations);
 	}
 	if(progress)
 		progress->EndTask();
 
-	if(out_size1) *out_size1 = best_size1;
-	if(out_size2) *out_size2 = best_size2;
+	delete linker;
+
+	if(out_size1) *out_size1 = best.size1;
+	if(out_size2) *out_size2 = best.size2;
 
-	delete[] backup;
 	int timespent = (clock() - stime)/CLOCKS_PER_SEC;
 	printf("Time spent: %dm%02ds\n", timespent/60, timespent%60);
 	return best_total_size;
-}
\ No newline at end of file
+}
@@ -2,18 +2,51 @@
 #ifndef _EMPIRICAL_HUNK_SORTER_H_
 #define _EMPIRICAL_HUNK_SORTER_H_
 
+#include <vector>
+#include <unordered_map>
+
+enum HunkSearchType {
+	HUNK_SEARCH_HILLCLIMB, HUNK_SEARCH_ANNEAL, HUNK_SEARCH_TABU
+};
+
+inline const char *HunkSearchTypeName(HunkSearchType type) {
+	switch (type) {
+	case HUNK_SEARCH_HILLCLIMB:
+		return "HILLCLIMB";
+	case HUNK_SEARCH_ANNEAL:
+		return "ANNEAL";
+	case HUNK_SEARCH_TABU:
+		return "TABU";
+	}
+	return "";
+}
+
+class Hunk;
 class HunkList;
+class Symbol;
 class ModelList4k;
 class ModelList1k;
 class ProgressBar;
 class Transform;
+class IncrementalLinker;
 class EmpiricalHunkSorter {
-	static int TryHunkCombination(HunkList* hunklist, Transform& transform, ModelList4k& codeModels, ModelList4k& dataModels, ModelList1k& models1k, int baseprob, bool saturate, bool use1KMode, int* out_size1, int* out_size2);
+	// Linked image of an evaluated hunk order and the compressed sizes of its segments
+	struct LinkedImage {
+		std::vector<unsigned char>	data;
+		int							splittingPoint;
+		int							size1;
+		int							size2;
+	};
+
+	static int TryHunkCombination(HunkList* hunklist, Transform& transform, Symbol* import, const IncrementalLinker* linker, ModelList4k& codeModels, ModelList4k& dataModels, ModelList1k& models1k, int baseprob, bool saturate, bool use1KMode, const LinkedImage* reference, LinkedImage& result);
+
+	// Ideal compressed cost per byte of each initialized hunk in the linked image, in BIT_PRECISION units
+	static void ComputeHunkCosts(const HunkList* hunklist, const IncrementalLinker* linker, const LinkedImage& image, ModelList4k& codeModels, ModelList4k& dataModels, int baseprob, bool saturate, std::unordered_map<const Hunk*, int>& costs);
 public:
 	EmpiricalHunkSorter();
 	~EmpiricalHunkSorter();
 
-	static int SortHunkList(HunkList* hunklist, Transform& transform, ModelList4k& codeModels, ModelList4k& dataModels, ModelList1k& models1k, int baseprob, bool saturate, int numIterations, ProgressBar* progress, bool use1KMode, int* out_size1, int* out_size2);
+	static int SortHunkList(HunkList* hunklist, Transform& transform, ModelList4k& codeModels, ModelList4k& dataModels, ModelList1k& models1k, int baseprob, bool saturate, int numIterations, HunkSearchType searchType, ProgressBar* progress, bool use1KMode, int* out_size1, int* out_size2);
 };
 
 #endif
\ No newline at end of file
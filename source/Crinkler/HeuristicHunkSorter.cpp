@@ -5,9 +5,19 @@
 #include <vector>
 #include <algorithm>
 #include <cstring>
+#include <unordered_map>
 
 using namespace std;
 
+// Number of smallest distinct n-gram hashes kept per hunk for similarity estimation
+static const int AFFINITY_SKETCH_SIZE = 64;
+
+// Affinity added per relocation between two hunks, in units of shared sketch entries
+static const int AFFINITY_RELOCATION_WEIGHT = 8;
+
+// Runs longer than this are left in heuristic order, as all pairs are compared
+static const int AFFINITY_MAX_RUN_LENGTH = 1000;
+
 static bool HunkRelation(Hunk* h1, Hunk* h2) {
 	// Initialized data < uninitialized data
 	if((h1->GetRawSize() != 0) != (h2->GetRawSize() != 0))
@@ -42,7 +52,7 @@ static bool HunkRelation(Hunk* h1, Hunk* h2) {
 		else {
 			{
 				// Compare data
-				return memcmp(h1->GetPtr(), h2->GetPtr(), h1->GetRawSize()) > 0;
+				return memcmp(h1->GetData(), h2->GetData(), h1->GetRawSize()) > 0;
 			}
 		}				
 	}
@@ -81,3 +91,214 @@ void HeuristicHunkSorter::SortHunkList(HunkList* hunklist) {
 	// Copy hunks back to hunklist
 	for(Hunk *hunk : hunks) hunklist->AddHunkBack(hunk);
 }
+
+// Bottom-k sketch of the distinct 4-byte sequences in the hunk
+static vector<unsigned int> NgramSketch(Hunk* hunk) {
+	const unsigned char* data = (const unsigned char*)hunk->GetData();
+	vector<unsigned int> hashes;
+	for(int i = 0; i + 4 <= hunk->GetRawSize(); i++) {
+		unsigned int ngram = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) | (data[i + 3] << 24);
+		hashes.push_back(ngram * 0x9E3779B1u);
+	}
+	sort(hashes.begin(), hashes.end());
+	hashes.erase(unique(hashes.begin(), hashes.end()), hashes.end());
+	if((int)hashes.size() > AFFINITY_SKETCH_SIZE)
+		hashes.resize(AFFINITY_SKETCH_SIZE);
+	return hashes;
+}
+
+// Number of entries among the smallest AFFINITY_SKETCH_SIZE of the union that are in both sketches
+static int SharedNgrams(const vector<unsigned int>& a, const vector<unsigned int>& b) {
+	int shared = 0;
+	size_t i = 0, j = 0;
+	for(int n = 0; n < AFFINITY_SKETCH_SIZE && (i < a.size() || j < b.size()); n++) {
+		if(j == b.size() || (i < a.size() && a[i] < b[j])) {
+			i++;
+		} else if(i == a.size() || b[j] < a[i]) {
+			j++;
+		} else {
+			shared++;
+			i++;
+			j++;
+		}
+	}
+	return shared;
+}
+
+// Order hunks as paths through the heaviest affinity edges, taking edges greedily.
+// Paths are placed in the order of their earliest hunk, so unrelated hunks keep their order.
+static void OrderRunByAffinity(vector<Hunk*>& run, const vector<vector<unsigned int>>& sketches, const unordered_map<const Hunk*, unordered_map<const Hunk*, int>>& references) {
+	int n = (int)run.size();
+
+	struct Edge {
+		int weight;
+		int a, b;
+	};
+	vector<Edge> edges;
+	for(int a = 0; a < n; a++) {
+		auto refs = references.find(run[a]);
+		for(int b = a + 1; b < n; b++) {
+			int weight = SharedNgrams(sketches[a], sketches[b]);
+			if(refs != references.end()) {
+				auto ref = refs->second.find(run[b]);
+				if(ref != refs->second.end())
+					weight += ref->second * AFFINITY_RELOCATION_WEIGHT;
+			}
+			if(weight > 0)
+				edges.push_back(Edge { weight, a, b });
+		}
+	}
+	stable_sort(edges.begin(), edges.end(), [](const Edge& e1, const Edge& e2) { return e1.weight > e2.weight; });
+
+	// Link hunks into paths. A hunk can have at most two neighbors, and paths must not close.
+	vector<int> neighbors[2] = { vector<int>(n, -1), vector<int>(n, -1) };
+	vector<int> pathEnd(n);		// For a path endpoint, the other endpoint
+	for(int i = 0; i < n; i++)
+		pathEnd[i] = i;
+	for(const Edge& e : edges) {
+		if(neighbors[1][e.a] != -1 || neighbors[1][e.b] != -1 || pathEnd[e.a] == e.b)
+			continue;
+		neighbors[neighbors[0][e.a] == -1 ? 0 : 1][e.a] = e.b;
+		neighbors[neighbors[0][e.b] == -1 ? 0 : 1][e.b] = e.a;
+		int endA = pathEnd[e.a];
+		int endB = pathEnd[e.b];
+		pathEnd[endA] = endB;
+		pathEnd[endB] = endA;
+	}
+
+	// Walk each path from its earliest endpoint
+	vector<Hunk*> ordered;
+	vector<bool> placed(n, false);
+	for(int i = 0; i < n; i++) {
+		if(placed[i])
+			continue;
+		int start = i;
+		if(neighbors[1][i] != -1) {
+			// Interior hunk: start from whichever endpoint comes first
+			int endpoints[2];
+			for(int side = 0; side < 2; side++) {
+				int prev = i;
+				int cur = neighbors[side][i];
+				while(true) {
+					int next = neighbors[0][cur] == prev ? neighbors[1][cur] : neighbors[0][cur];
+					if(next == -1)
+						break;
+					prev = cur;
+					cur = next;
+				}
+				endpoints[side] = cur;
+			}
+			start = min(endpoints[0], endpoints[1]);
+		} else if(neighbors[0][i] != -1) {
+			start = min(i, pathEnd[i]);
+		}
+
+		int prev = -1;
+		int cur = start;
+		while(cur != -1) {
+			ordered.push_back(run[cur]);
+			placed[cur] = true;
+			int next = neighbors[0][cur] == prev ? neighbors[1][cur] : neighbors[0][cur];
+			prev = cur;
+			cur = next;
+		}
+	}
+	run = ordered;
+}
+
+void HeuristicHunkSorter::OrderByAffinity(HunkList* hunklist) {
+	Hunk *import_hunk = hunklist->FindSymbol("_Import")->hunk;
+	Hunk *entry_hunk = import_hunk->GetContinuation()->hunk;
+	Hunk *initializer_hunk = NULL;
+	if (entry_hunk->GetContinuation() != NULL) {
+		initializer_hunk = entry_hunk;
+		entry_hunk = initializer_hunk->GetContinuation()->hunk;
+	}
+
+	// Hunks with a fixed place are not reordered
+	auto isFixed = [&](Hunk* h) {
+		return h == import_hunk || h == initializer_hunk || h == entry_hunk ||
+			h->GetRawSize() == 0 ||
+			(h->GetFlags() & (HUNK_IS_LEADING | HUNK_IS_TRAILING)) ||
+			strcmp(h->GetName(), "ImportListHunk") == 0;
+	};
+
+	// Count relocations between hunks in both directions
+	unordered_map<const Hunk*, unordered_map<const Hunk*, int>> references;
+	for(int i = 0; i < hunklist->GetNumHunks(); i++) {
+		Hunk* h = (*hunklist)[i];
+		for(int r = 0; r < h->GetNumRelocations(); r++) {
+			Symbol* s = hunklist->FindSymbol(h->GetRelocations()[r].symbolname);
+			if(s && s->hunk != h) {
+				references[h][s->hunk]++;
+				references[s->hunk][h]++;
+			}
+		}
+	}
+
+	// Reorder maximal runs of movable hunks with the same section type and alignment
+	int n = hunklist->GetNumHunks();
+	int start = 0;
+	while(start < n) {
+		Hunk* first = (*hunklist)[start];
+		int end = start + 1;
+		if(!isFixed(first)) {
+			while(end < n) {
+				Hunk* h = (*hunklist)[end];
+				if(isFixed(h) || (h->GetFlags() & HUNK_IS_CODE) != (first->GetFlags() & HUNK_IS_CODE) ||
+					h->GetAlignmentBits() != first->GetAlignmentBits())
+					break;
+				end++;
+			}
+		}
+
+		if(end - start > 2 && end - start <= AFFINITY_MAX_RUN_LENGTH) {
+			vector<Hunk*> run;
+			vector<vector<unsigned int>> sketches;
+			for(int i = start; i < end; i++) {
+				run.push_back((*hunklist)[i]);
+				sketches.push_back(NgramSketch((*hunklist)[i]));
+			}
+			OrderRunByAffinity(run, sketches, references);
+			for(int i = start; i < end; i++)
+				hunklist->SetHunk(i, run[i - start]);
+		}
+		start = end;
+	}
+}
+
+void HeuristicHunkSorter::FindSimilarHunks(HunkList* hunklist, int maxSimilar, unordered_map<const Hunk*, vector<Hunk*>>& similar) {
+	similar.clear();
+	for(int code = 0; code < 2; code++) {
+		vector<Hunk*> hunks;
+		for(int i = 0; i < hunklist->GetNumHunks(); i++) {
+			Hunk* h = (*hunklist)[i];
+			if(h->GetRawSize() > 0 && ((h->GetFlags() & HUNK_IS_CODE) != 0) == (code != 0))
+				hunks.push_back(h);
+		}
+
+		// All pairs are compared
+		int n = (int)hunks.size();
+		if(n > AFFINITY_MAX_RUN_LENGTH)
+			continue;
+
+		vector<vector<unsigned int>> sketches;
+		for(Hunk* h : hunks)
+			sketches.push_back(NgramSketch(h));
+
+		for(int a = 0; a < n; a++) {
+			vector<pair<int, int>> scores;		// (-shared, index)
+			for(int b = 0; b < n; b++) {
+				int shared = b != a ? SharedNgrams(sketches[a], sketches[b]) : 0;
+				if(shared > 0)
+					scores.push_back(make_pair(-shared, b));
+			}
+			int count = min((int)scores.size(), maxSimilar);
+			partial_sort(scores.begin(), scores.begin() + count, scores.end());
+
+			vector<Hunk*>& list = similar[hunks[a]];
+			for(int k = 0; k < count; k++)
+				list.push_back(hunks[scores[k].second]);
+		}
+	}
+}
@@ -2,10 +2,21 @@
 #ifndef _HEURISTIC_HUNK_SORTER_H_
 #define _HEURISTIC_HUNK_SORTER_H_
 
+#include <vector>
+#include <unordered_map>
+
+class Hunk;
 class HunkList;
 class HeuristicHunkSorter {
 public:
 	static void SortHunkList(HunkList* hunklist);
+
+	// Reorder runs of interchangeable hunks so that similar and mutually referencing hunks are adjacent
+	static void OrderByAffinity(HunkList* hunklist);
+
+	// For each initialized hunk, up to maxSimilar hunks of the same section type with the most
+	// similar content, most similar first
+	static void FindSimilarHunks(HunkList* hunklist, int maxSimilar, std::unordered_map<const Hunk*, std::vector<Hunk*>>& similar);
 };
 
 #endif
\ No newline at end of file
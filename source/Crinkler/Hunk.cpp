@@ -1,12 +1,15 @@
 #include <memory>
 #include <vector>
+#include <atomic>
 #include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <functional>
 
 #include "StringMisc.h"
 #include "misc.h"
 #include "Hunk.h"
+#include "HunkList.h"
 #include "NameMangling.h"
 #include "Log.h"
 #include "Symbol.h"
@@ -46,6 +49,7 @@ static int GetType(int level) {
 
 Hunk::Hunk(const Hunk& h) : 
 	m_alignmentBits(h.m_alignmentBits), m_flags(h.m_flags), m_data(h.m_data),
+	m_sharedData(h.m_sharedData), m_sharedSize(h.m_sharedSize),
 	m_virtualsize(h.m_virtualsize), m_relocations(h.m_relocations), m_name(h.m_name),
 	m_importName(h.m_importName), m_importDll(h.m_importDll), m_numReferences(0),
 	m_alignmentOffset(0), m_continuation(NULL)
@@ -56,11 +60,17 @@ Hunk::Hunk(const Hunk& h) :
 		s->hunk = this;
 		m_symbols[p.second->name] = s;
 	}
+
+	// Bound relocations refer to the copied symbols
+	m_relocationTargets.reserve(h.m_relocationTargets.size());
+	for(Symbol* target : h.m_relocationTargets) {
+		m_relocationTargets.push_back(target ? m_symbols[target->name] : NULL);
+	}
 }
 
 
 Hunk::Hunk(const char* symbolName, const char* importName, const char* importDll) :
-	m_name(symbolName), m_virtualsize(0),
+	m_name(symbolName), m_virtualsize(0), m_sharedData(NULL), m_sharedSize(0),
 	m_flags(HUNK_IS_IMPORT), m_alignmentBits(0), m_importName(importName),
 	m_importDll(importDll), m_numReferences(0),
 	m_alignmentOffset(0), m_continuation(NULL)
@@ -69,11 +79,16 @@ Hunk::Hunk(const char* symbolName, const char* importName, const char* importDll
 }
 
 
-Hunk::Hunk(const char* name, const char* data, unsigned int flags, int alignmentBits, int rawsize, int virtualsize) :
+Hunk::Hunk(const char* name, const char* data, unsigned int flags, int alignmentBits, int rawsize, int virtualsize, bool shareData) :
 	m_name(name), m_flags(flags), m_alignmentBits(alignmentBits),
-	m_virtualsize(virtualsize), m_numReferences(0),
+	m_virtualsize(virtualsize), m_numReferences(0), m_sharedData(NULL), m_sharedSize(0),
 	m_alignmentOffset(0), m_continuation(NULL)
 {
+	if(shareData && data != NULL && rawsize > 0) {
+		m_sharedData = data;
+		m_sharedSize = rawsize;
+		return;
+	}
 	m_data.resize(rawsize);
 	if(data != NULL)
 		copy(data, data+rawsize, m_data.begin());
@@ -83,30 +98,65 @@ Hunk::Hunk(const char* name, const char* data, unsigned int flags, int alignment
 Hunk::~Hunk() {
 	// Free symbols
 	for(auto& p : m_symbols) {
-		delete p.second;
+		DeleteSymbol(p.second);
 	}
 }
 
 void Hunk::AddSymbol(Symbol* s) {
-	map<string, Symbol*>::iterator it = m_symbols.find(s->name.c_str());
+	auto it = m_symbols.find(s->name);
 	if(it == m_symbols.end()) {
 		m_symbols.insert(make_pair(s->name, s));
+		HunkList::SymbolAdded(this);
 	} else {
 		Symbol* oldSym = it->second;
 		if(oldSym->secondaryName.size() > 0) {
-			// Overwrite weak symbols
-			m_symbols[s->name.c_str()] = s;
-			delete oldSym;
+			// Overwrite weak symbols. This can change what relocations resolve to.
+			it->second = s;
+			DeleteSymbol(oldSym);
+			UnbindRelocations();
 		} else {
-			delete s;
+			DeleteSymbol(s);
 		}
 	}
 }
 
+void Hunk::DeleteSymbol(Symbol* s) {
+	// Symbols in the storage block are freed with the hunk. std::less gives a total order
+	// on pointers, which the built-in comparisons do not for unrelated objects.
+	less<const Symbol*> before;
+	bool stored = !m_symbolStorage.empty() && !before(s, &m_symbolStorage.front()) && !before(&m_symbolStorage.back(), s);
+	if(!stored)
+		delete s;
+}
+
 void Hunk::AddRelocation(Relocation r) {
 	assert(r.offset >= 0);
 	assert(r.offset <= GetRawSize()-4);
 	m_relocations.push_back(r);
+	m_relocationTargets.push_back(NULL);
+}
+
+Symbol* Hunk::GetRelocationTarget(int index) const {
+	Symbol* s = m_relocationTargets[index];
+	if(s == NULL) {
+		// Not bound: resolve by name
+		s = FindSymbol(m_relocations[index].symbolname);
+		if(s && s->secondaryName.size() > 0)
+			s = FindSymbol(s->secondaryName);
+	}
+	return s;
+}
+
+void Hunk::UnbindRelocations() {
+	fill(m_relocationTargets.begin(), m_relocationTargets.end(), (Symbol*)NULL);
+}
+
+void Hunk::Unshare() {
+	if(m_sharedData) {
+		m_data.assign(m_sharedData, m_sharedData + m_sharedSize);
+		m_sharedData = NULL;
+		m_sharedSize = 0;
+	}
 }
 
 void Hunk::PrintSymbols() const {
@@ -136,7 +186,15 @@ Symbol* Hunk::FindUndecoratedSymbol(const char* name) const {
 }
 
 Symbol* Hunk::FindSymbol(const char* name) const {
-	map<string, Symbol*>::const_iterator it = m_symbols.find(name);
+	auto it = m_symbols.find(name);
+	if(it != m_symbols.end())
+		return it->second;
+	else
+		return NULL;
+}
+
+Symbol* Hunk::FindSymbol(const PooledString& name) const {
+	auto it = m_symbols.find(name);
 	if(it != m_symbols.end())
 		return it->second;
 	else
@@ -165,12 +223,11 @@ static const char* HelpMessage(const char* name) {
 }
 
 void Hunk::Relocate(int imageBase) {
+	Unshare();
 	bool error = false;
-	for(const Relocation& relocation : m_relocations) {
-		// Find symbol
-		Symbol* s = FindSymbol(relocation.symbolname.c_str());
-		if(s && s->secondaryName.size() > 0)
-			s = FindSymbol(s->secondaryName.c_str());
+	for(int i = 0; i < (int)m_relocations.size(); i++) {
+		const Relocation& relocation = m_relocations[i];
+		Symbol* s = GetRelocationTarget(i);
 		if(s != NULL) {
 			// Perform relocation
 			int* word = (int*)&m_data[relocation.offset];
@@ -215,6 +272,14 @@ void Hunk::Relocate(int imageBase) {
 }
 
 void Hunk::SetRawSize(int size) {
+	if(m_sharedData && size <= m_sharedSize) {
+		// Shorten the reference
+		m_sharedSize = size;
+		if(size == 0)
+			m_sharedData = NULL;
+		return;
+	}
+	Unshare();
 	m_data.resize(size);
 }
 
@@ -230,16 +295,22 @@ void Hunk::Trim() {
 		farestReloc = max(relocation.offset+relocSize, farestReloc);
 	}
 
-	while((int)m_data.size() > farestReloc && m_data.back() == 0)
-		m_data.pop_back();
+	// Trimming shared data only shortens the reference
+	int size = GetRawSize();
+	const char* data = GetData();
+	while(size > farestReloc && data[size - 1] == 0)
+		size--;
+	SetRawSize(size);
 }
 
 void Hunk::AppendZeroes(int num) {
+	Unshare();
 	while(num--)
 		m_data.push_back(0);
 }
 
 void Hunk::Insert(int offset, const unsigned char* data, int size) {
+	Unshare();
 	m_data.resize(m_data.size() + size);
 	memmove(&m_data[offset + size], &m_data[offset], m_data.size() - (offset + size));
 	memcpy(&m_data[offset], data, size);
@@ -341,10 +412,9 @@ CompressionReportRecord* Hunk::GetCompressionSummary(int* sizefill, int splittin
 map<int, Symbol*> Hunk::GetOffsetToRelocationMap() {
 	map<int, Symbol*> offsetmap;
 	map<int, Symbol*> symbolmap = GetOffsetToSymbolMap();
-	for(Relocation& relocation : m_relocations) {
-		Symbol* s = FindSymbol(relocation.symbolname.c_str());
-		if(s && s->secondaryName.size() > 0)
-			s = FindSymbol(s->secondaryName.c_str());
+	for(int i = 0; i < (int)m_relocations.size(); i++) {
+		const Relocation& relocation = m_relocations[i];
+		Symbol* s = GetRelocationTarget(i);
 		if(s && s->flags & SYMBOL_IS_RELOCATEABLE && s->flags & SYMBOL_IS_SECTION)
 			s = symbolmap.find(s->value)->second;	// Replace relocation to section with non-section
 		offsetmap.insert(make_pair(relocation.offset, s));
@@ -412,7 +482,7 @@ void Hunk::RoundFloats(int defaultBits) {
 					goto endit;
 			}
 
-			int* ptr = (int*)&m_data[address];
+			int* ptr = (int*)&GetPtr()[address];
 			if(isDouble) {
 				double orgf = *(double*)ptr;
 				int orgi0 = ptr[0];
@@ -490,17 +560,18 @@ const string& Hunk::GetID() {
 				}
 			}
 		}
+		const string& name = m_name;
 		string section_name;
-		int i0 = (int)m_name.find_first_of('[', 0);
-		int i1 = (int)m_name.find_last_of('\\');
-		int i2 = (int)m_name.find_first_of(']', 0);
-		int i3 = (int)m_name.find_last_of('!');
+		int i0 = (int)name.find_first_of('[', 0);
+		int i1 = (int)name.find_last_of('\\');
+		int i2 = (int)name.find_first_of(']', 0);
+		int i3 = (int)name.find_last_of('!');
 		i1 = max(i0, i1);
 		if (i1 != -1 && i2 != -1 && i3 != -1 && i1 < i2 && i2 < i3) {
-			section_name = m_name.substr(i1 + 1, i2 - (i1 + 1)) + ":" + m_name.substr(i3 + 1);
+			section_name = name.substr(i1 + 1, i2 - (i1 + 1)) + ":" + name.substr(i3 + 1);
 		}
 		else {
-			section_name = m_name;
+			section_name = name;
 		}
 		m_cached_id = section_name + ":" + StripCrinklerSymbolPrefix(first->name.c_str());
 	}
@@ -6,6 +6,8 @@
 #include <map>
 #include <vector>
 
+#include "StringPool.h"
+
 const int HUNK_IS_CODE =		0x01;
 const int HUNK_IS_WRITEABLE =	0x02;
 const int HUNK_IS_IMPORT =		0x04;
@@ -74,33 +76,46 @@ struct CompressionReportRecord {
 };
 
 struct Relocation {
-	std::string		symbolname;
+	PooledString	symbolname;
 	int				offset;
 	RelocationType	type;
-	std::string		objectname;
+	PooledString	objectname;
 };
 
 class Hunk {
 	friend class HunkList;
+	friend class IncrementalLinker;
+	friend class LibraryCache;
 	int				m_alignmentBits;
 	int				m_alignmentOffset;
 	unsigned int	m_flags;
 	int				m_virtualsize;
 
 	std::vector<char>	m_data;
+	const char*			m_sharedData;		// Data owned by the loader, used until the hunk is modified, or NULL
+	int					m_sharedSize;
 	std::vector<Relocation> m_relocations;
-	std::map<std::string, Symbol*> m_symbols;
+	std::vector<Symbol*> m_relocationTargets;		// Bound target symbol per relocation, with weak references resolved, or NULL
+	std::map<PooledString, Symbol*, PooledString::Less> m_symbols;
+	std::vector<Symbol>	m_symbolStorage;		// Symbols allocated as one block by HunkList::ToHunk, never reallocated
 	Symbol* m_continuation;
-	std::string m_name;
-	std::string m_importName;
-	std::string m_importDll;
+	PooledString m_name;
+	PooledString m_importName;
+	PooledString m_importDll;
 	std::string m_cached_id;
 
 	int			m_numReferences;
+	std::vector<const HunkList*>	m_indexingLists;	// Lists whose symbol index includes the hunk, guarded by HunkList
+
+	Symbol*		GetRelocationTarget(int index) const;
+	void		UnbindRelocations();
+	void		Unshare();
+	void		DeleteSymbol(Symbol* s);
 public:
 	Hunk(const Hunk& h);
 	Hunk(const char* symbolName, const char* importName, const char* importDll);
-	Hunk(const char* name, const char* data, unsigned int flags, int alignmentBits, int rawsize, int virtualsize);
+	// If shareData is set, the data is referenced until the hunk is modified and must stay valid
+	Hunk(const char* name, const char* data, unsigned int flags, int alignmentBits, int rawsize, int virtualsize, bool shareData = false);
 	~Hunk();
 
 	void		AddRelocation(Relocation r);
@@ -111,7 +126,9 @@ public:
 	Symbol*		GetContinuation() const							{ return m_continuation; }
 	Symbol*		FindUndecoratedSymbol(const char* name) const;
 	Symbol*		FindSymbol(const char* name) const;
+	Symbol*		FindSymbol(const PooledString& name) const;
 	void		PrintSymbols() const;
+
 	void		Relocate(int imageBase);
 	void		SetVirtualSize(int size)						{ m_virtualsize = size; }
 	void		SetRawSize(int size);
@@ -132,8 +149,9 @@ public:
 	int				GetAlignmentOffset() const		{ return m_alignmentOffset; }
 	unsigned int	GetFlags() const				{ return m_flags; }
 	const char*		GetName() const					{ return m_name.c_str(); }
-	char*			GetPtr()						{ return m_data.data(); }
-	int				GetRawSize() const				{ return (int)m_data.size(); }
+	char*			GetPtr()						{ Unshare(); return m_data.data(); }
+	const char*		GetData() const					{ return m_sharedData ? m_sharedData : m_data.data(); }
+	int				GetRawSize() const				{ return m_sharedData ? m_sharedSize : (int)m_data.size(); }
 	int				GetVirtualSize() const			{ return m_virtualsize; }
 	int				GetNumReferences() const		{ return m_numReferences; }
 	const char*		GetImportName() const			{ return m_importName.c_str(); }
@@ -4,15 +4,38 @@
 #include <stack>
 #include <algorithm>
 #include <cstring>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
 
 #include "Hunk.h"
 #include "Log.h"
 #include "misc.h"
+#include "NameMangling.h"
 #include "Symbol.h"
 
 using namespace std;
 
-HunkList::HunkList() {
+// Guards the lists registered in a hunk, as lists sharing hunks may index them concurrently
+static mutex& GetIndexingLock(const Hunk* hunk) {
+	static mutex locks[64];
+	return locks[(reinterpret_cast<uintptr_t>(hunk) / sizeof(void*)) % 64];
+}
+
+static void RegisterIndexingList(Hunk* hunk, vector<const HunkList*>& lists, const HunkList* list) {
+	lock_guard<mutex> lock(GetIndexingLock(hunk));
+	if(find(lists.begin(), lists.end(), list) == lists.end())
+		lists.push_back(list);
+}
+
+static void UnregisterIndexingList(Hunk* hunk, vector<const HunkList*>& lists, const HunkList* list) {
+	lock_guard<mutex> lock(GetIndexingLock(hunk));
+	lists.erase(remove(lists.begin(), lists.end(), list), lists.end());
+}
+
+HunkList::HunkList() :
+	m_indexed(false), m_undecoratedIndexed(false), m_positionsValid(false)
+{
 }
 
 HunkList::~HunkList() {
@@ -22,46 +45,146 @@ HunkList::~HunkList() {
 	}
 }
 
-Hunk*& HunkList::operator[] (unsigned idx) {
+Hunk* const & HunkList::operator[] (unsigned idx) const {
 	assert(idx < (int)m_hunks.size());
 	return m_hunks[idx];
 }
 
-Hunk* const & HunkList::operator[] (unsigned idx) const {
+void HunkList::SetHunk(unsigned idx, Hunk* hunk) {
 	assert(idx < (int)m_hunks.size());
-	return m_hunks[idx];
+	m_hunks[idx] = hunk;
+	HunksChanged();
 }
 
 void HunkList::AddHunkBack(Hunk* hunk) {
 	m_hunks.push_back(hunk);
+	if(m_indexed)
+		IndexHunk(hunk);
+	HunksChanged();
 }
 
 void HunkList::AddHunkFront(Hunk* hunk) {
 	m_hunks.insert(m_hunks.begin(), hunk);
+	if(m_indexed)
+		IndexHunk(hunk);
+	HunksChanged();
 }
 
 void HunkList::InsertHunk(int index, Hunk* hunk) {
 	m_hunks.insert(m_hunks.begin() + index, hunk);
+	if(m_indexed)
+		IndexHunk(hunk);
+	HunksChanged();
 }
 
 Hunk* HunkList::RemoveHunk(Hunk* hunk) {
 	vector<Hunk*>::iterator it = find(m_hunks.begin(), m_hunks.end(), hunk);
-	if(it != m_hunks.end())
+	if(it != m_hunks.end()) {
 		m_hunks.erase(it);
+		if(m_indexed)
+			UnindexHunk(hunk);
+		UnregisterIndexingList(hunk, hunk->m_indexingLists, this);
+		HunksChanged();
+	}
 	return hunk;
 }
 
 
 void HunkList::Clear() {
+	for(Hunk* hunk : m_hunks)
+		UnregisterIndexingList(hunk, hunk->m_indexingLists, this);
 	m_hunks.clear();
+	m_symbolIndex.clear();
+	m_undecoratedIndex.clear();
+	m_indexed = false;
+	m_undecoratedIndexed = false;
+	HunksChanged();
 }
 
 void HunkList::Append(HunkList* hunklist) {
+	bool indexCurrent = m_indexed;
 	for(Hunk* hunk : hunklist->m_hunks) {
-		m_hunks.push_back(new Hunk(*hunk));
+		m_hunks.push_back(hunk);
+		if(indexCurrent)
+			IndexHunk(hunk);
+	}
+	hunklist->Clear();
+	HunksChanged();
+}
+
+void HunkList::UpdateIndex() const {
+	if(m_indexed)
+		return;
+
+	m_symbolIndex.clear();
+	m_undecoratedIndex.clear();
+	m_undecoratedIndexed = false;
+	for(Hunk* hunk : m_hunks)
+		IndexHunk(hunk);
+	m_indexed = true;
+}
+
+void HunkList::IndexHunk(Hunk* hunk) const {
+	RegisterIndexingList(hunk, hunk->m_indexingLists, this);
+	for(const auto& p : hunk->m_symbols) {
+		m_symbolIndex[p.first].push_back(hunk);
+	}
+
+	if(m_undecoratedIndexed)
+		IndexUndecoratedNames(hunk);
+}
+
+void HunkList::IndexUndecoratedNames(Hunk* hunk) const {
+	// Symbols of a hunk are added in name order, as Hunk::FindUndecoratedSymbol searches them
+	for(const auto& p : hunk->m_symbols) {
+		m_undecoratedIndex[UndecorateSymbolName(p.first.c_str())].push_back(make_pair(hunk, p.first));
+	}
+}
+
+void HunkList::UnindexHunk(Hunk* hunk) const {
+	for(const auto& p : hunk->m_symbols) {
+		auto it = m_symbolIndex.find(p.first);
+		if(it != m_symbolIndex.end()) {
+			it->second.erase(remove(it->second.begin(), it->second.end(), hunk), it->second.end());
+			if(it->second.empty())
+				m_symbolIndex.erase(it);
+		}
+	}
+
+	if(m_undecoratedIndexed) {
+		for(const auto& p : hunk->m_symbols) {
+			auto it = m_undecoratedIndex.find(UndecorateSymbolName(p.first.c_str()));
+			if(it != m_undecoratedIndex.end()) {
+				auto& entries = it->second;
+				entries.erase(remove_if(entries.begin(), entries.end(), [hunk](const pair<Hunk*, PooledString>& e) { return e.first == hunk; }), entries.end());
+				if(entries.empty())
+					m_undecoratedIndex.erase(it);
+			}
+		}
 	}
 }
 
+void HunkList::SymbolAdded(Hunk* hunk) {
+	lock_guard<mutex> lock(GetIndexingLock(hunk));
+	for(const HunkList* list : hunk->m_indexingLists)
+		list->m_indexed = false;
+}
+
+void HunkList::HunksChanged() {
+	m_positionsValid = false;
+}
+
+int HunkList::GetPosition(const Hunk* hunk) const {
+	if(!m_positionsValid) {
+		m_positions.clear();
+		for(int i = 0; i < (int)m_hunks.size(); i++) {
+			m_positions[m_hunks[i]] = i;
+		}
+		m_positionsValid = true;
+	}
+	return m_positions.find(hunk)->second;
+}
+
 bool HunkList::NeedsContinuationJump(vector<Hunk*>::const_iterator &it) const {
 	Hunk *h = *it;
 	Symbol *cont = h->GetContinuation();
@@ -118,6 +241,13 @@ Hunk* HunkList::ToHunk(const char* name, int baseAddress, int* splittingPoint) c
 	if(splittingPoint != NULL)
 		*splittingPoint = -1;
 
+	// Copy all symbols into one block
+	int numSymbols = 0;
+	for(Hunk* h : m_hunks)
+		numSymbols += (int)h->m_symbols.size();
+	newHunk->m_symbolStorage.reserve(numSymbols);
+	unordered_map<const Symbol*, Symbol*> copies;
+	copies.reserve(numSymbols);
 	for(vector<Hunk*>::const_iterator it = m_hunks.begin(); it != m_hunks.end(); it++) {
 		Hunk* h = *it;
 		// Align
@@ -127,12 +257,14 @@ Hunk* HunkList::ToHunk(const char* name, int baseAddress, int* splittingPoint) c
 
 		// Copy symbols
 		for(const auto& p :h->m_symbols) {
-			Symbol* s = new Symbol(*p.second);
+			newHunk->m_symbolStorage.push_back(*p.second);
+			Symbol* s = &newHunk->m_symbolStorage.back();
 			s->hunk = newHunk;
 			if(s->flags & SYMBOL_IS_RELOCATEABLE) {
 				s->value += address;
 				s->hunk_offset = p.second->hunk_offset + address;
 			}
+			copies[p.second] = s;
 			newHunk->AddSymbol(s);
 		}
 
@@ -145,67 +277,121 @@ Hunk* HunkList::ToHunk(const char* name, int baseAddress, int* splittingPoint) c
 		if(splittingPoint && *splittingPoint == -1 && !(h->GetFlags() & HUNK_IS_CODE))
 			*splittingPoint = address;
 
-		memcpy(&newHunk->GetPtr()[address], h->GetPtr(), h->GetRawSize());
+		memcpy(&newHunk->GetPtr()[address], h->GetData(), h->GetRawSize());
 		if (NeedsContinuationJump(it)) {
 			unsigned char jumpCode[5] = {0xE9, 0x00, 0x00, 0x00, 0x00};
 			memcpy(&newHunk->GetPtr()[address+h->GetRawSize()], jumpCode, 5);
-			Relocation r = {h->GetContinuation()->name.c_str(), address+h->GetRawSize()+1, RELOCTYPE_REL32};
+			Relocation r = {h->GetContinuation()->name, address+h->GetRawSize()+1, RELOCTYPE_REL32};
 			newHunk->AddRelocation(r);
 			address += h->GetRawSize()+5;
 		} else {
 			address += h->GetVirtualSize();
 		}
 	}
+
+	// Bind relocations to the copied symbols, so relocating the linked hunk needs no lookups.
+	// Symbols are merged by the same rules as FindSymbol, so the copy of the symbol found
+	// here is the one kept in the linked hunk.
+	for(int i = 0; i < newHunk->GetNumRelocations(); i++) {
+		Symbol* s = FindSymbol(newHunk->m_relocations[i].symbolname);
+		if(s && s->secondaryName.size() > 0)
+			s = FindSymbol(s->secondaryName);
+		if(s)
+			newHunk->m_relocationTargets[i] = copies.find(s)->second;
+	}
 	newHunk->Trim();
 
 	return newHunk;
 }
 
 Symbol* HunkList::FindUndecoratedSymbol(const char* name) const {
-	// Weak libs (0) < weak (1) < libs (2) < normal (3)
+	UpdateIndex();
+	if(!m_undecoratedIndexed) {
+		for(Hunk* hunk : m_hunks)
+			IndexUndecoratedNames(hunk);
+		m_undecoratedIndexed = true;
+	}
+
+	auto it = m_undecoratedIndex.find(name);
+	if(it == m_undecoratedIndex.end())
+		return NULL;
+
+	// Weak libs (0) < weak (1) < libs (2) < normal (3).
+	// On equal level, the first hunk in the list wins.
 	int best_level = -1;
+	int best_position = 0;
 	Symbol* res = NULL;
-	for(const Hunk* hunk : m_hunks) {
-		Symbol* s = hunk->FindUndecoratedSymbol(name);
-		if(s != NULL) {
-			int level = 0;
-			if(s->fromLibrary) {
-				if(s->secondaryName.empty()) {
-					level = 2;
-				} else {
-					level = 0;
-				}
+	const Hunk* previous = NULL;
+	for(const auto& entry : it->second) {
+		// Only the first matching symbol of a hunk counts
+		if(entry.first == previous)
+			continue;
+		previous = entry.first;
+
+		Symbol* s = entry.first->FindSymbol(entry.second);
+		int level = 0;
+		if(s->fromLibrary) {
+			if(s->secondaryName.empty()) {
+				level = 2;
 			} else {
-				if(s->secondaryName.empty()) {
-					level = 3;
-				} else {
-					level = 1;
-				}
+				level = 0;
 			}
-			if(level > best_level) {
-				best_level = level;
-				res = s;
+		} else {
+			if(s->secondaryName.empty()) {
+				level = 3;
+			} else {
+				level = 1;
 			}
 		}
-		
+		int position = it->second.size() > 1 ? GetPosition(entry.first) : 0;
+		if(level > best_level || (level == best_level && position < best_position)) {
+			best_level = level;
+			best_position = position;
+			res = s;
+		}
 	}
 
 	return res;
 }
 
 Symbol* HunkList::FindSymbol(const char* name) const {
-	Symbol* res = NULL;
-	for(Hunk* hunk : m_hunks) {
+	// Names that are not pooled are not the name of any symbol
+	PooledString pooledName;
+	if(!PooledString::Find(name, pooledName))
+		return NULL;
+	return FindSymbol(pooledName);
+}
+
+Symbol* HunkList::FindSymbol(const PooledString& name) const {
+	UpdateIndex();
+	auto it = m_symbolIndex.find(name);
+	if(it == m_symbolIndex.end())
+		return NULL;
+	if(it->second.size() == 1)
+		return it->second[0]->FindSymbol(name);
+
+	// Defined by several hunks: the first strong symbol in the list wins, otherwise the last weak one
+	Symbol* strong = NULL;
+	Symbol* weak = NULL;
+	int strong_position = 0;
+	int weak_position = 0;
+	for(Hunk* hunk : it->second) {
 		Symbol* s = hunk->FindSymbol(name);
-		if(s != NULL) {
-			if(s->secondaryName.size() == 0)
-				return s;
-			else
-				res = s;
+		int position = GetPosition(hunk);
+		if(s->secondaryName.size() == 0) {
+			if(strong == NULL || position < strong_position) {
+				strong = s;
+				strong_position = position;
+			}
+		} else {
+			if(weak == NULL || position > weak_position) {
+				weak = s;
+				weak_position = position;
+			}
 		}
 	}
 
-	return res;
+	return strong ? strong : weak;
 }
 
 void HunkList::RemoveUnreferencedHunks(vector<Hunk*> startHunks) {
@@ -221,12 +407,12 @@ void HunkList::RemoveUnreferencedHunks(vector<Hunk*> startHunks) {
 		stak.pop();
 
 		for(Relocation& relocation : h->m_relocations) {
-			Symbol* s = FindSymbol(relocation.symbolname.c_str());
+			Symbol* s = FindSymbol(relocation.symbolname);
 			
 			if(s) {
 				if(s->secondaryName.size() > 0)	{	// Weak symbol
 					s->hunk->m_numReferences++;
-					s = FindSymbol(s->secondaryName.c_str());
+					s = FindSymbol(s->secondaryName);
 					if(s == NULL)
 						continue;
 				}
@@ -246,6 +432,10 @@ void HunkList::RemoveUnreferencedHunks(vector<Hunk*> startHunks) {
 			it++;
 		}
 	}
+
+	// Rebuild the index on next lookup
+	m_indexed = false;
+	HunksChanged();
 }
 
 void HunkList::RemoveImportHunks() {
@@ -258,6 +448,10 @@ void HunkList::RemoveImportHunks() {
 			it++;
 		}
 	}
+
+	// Rebuild the index on next lookup
+	m_indexed = false;
+	HunksChanged();
 }
 
 void HunkList::Trim() {
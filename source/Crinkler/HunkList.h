@@ -3,27 +3,62 @@
 #define _HUNK_LIST_H_
 
 #include <vector>
+#include <string>
+#include <unordered_map>
+
+#include "StringPool.h"
 
 class Hunk;
 class Symbol;
 class HunkList {
 	std::vector<Hunk*>	m_hunks;
+
+	// Index from symbol names and undecorated symbol names to the hunks defining them.
+	// Built on first lookup and updated as hunks are added and removed. Adding a symbol to a
+	// hunk marks the indices of the lists containing it for rebuilding on their next lookup.
+	// Lookups update the index, so they must not run concurrently on the same list.
+	mutable std::unordered_map<PooledString, std::vector<Hunk*>, PooledString::Hash>			m_symbolIndex;
+	mutable std::unordered_map<std::string, std::vector<std::pair<Hunk*, PooledString>>>		m_undecoratedIndex;
+	mutable bool											m_indexed;
+	mutable bool											m_undecoratedIndexed;
+
+	// Position of each hunk, for resolving symbols defined by several hunks
+	mutable std::unordered_map<const Hunk*, int>			m_positions;
+	mutable bool											m_positionsValid;
+
+	void	UpdateIndex() const;
+	void	IndexHunk(Hunk* hunk) const;
+	void	IndexUndecoratedNames(Hunk* hunk) const;
+	void	UnindexHunk(Hunk* hunk) const;
+	void	HunksChanged();
+	int		GetPosition(const Hunk* hunk) const;
+
+	// Called by Hunk when it gets a symbol with a new name
+	friend class Hunk;
+	static void	SymbolAdded(Hunk* hunk);
 public:
 	HunkList();
 	~HunkList();
 
-	Hunk*& operator[] (unsigned idx);
+	// Hunks are owned by one list and moved between lists, never copied with it
+	HunkList(const HunkList&) = delete;
+	HunkList& operator=(const HunkList&) = delete;
+
 	Hunk* const & operator[] (unsigned idx) const;
 
+	// Replace the hunk at a position. Must only be used to reorder the hunks of the list.
+	void	SetHunk(unsigned idx, Hunk* hunk);
+
 	void	AddHunkBack(Hunk* hunk);
 	void	AddHunkFront(Hunk* hunk);
 	Hunk*	RemoveHunk(Hunk* hunk);
-	void	Append(HunkList* hunklist);
+	void	Append(HunkList* hunklist);		// Moves the hunks, leaving hunklist empty
 	int		GetNumHunks() const { return (int)m_hunks.size(); }
 	Hunk*	ToHunk(const char* name, int base_address = 0, int* splittingPoint = NULL) const;
 	void	InsertHunk(int index, Hunk* hunk);
 
 	Symbol* FindSymbol(const char* name) const;
+	Symbol* FindSymbol(const PooledString& name) const;
 	Symbol* FindUndecoratedSymbol(const char* name) const;
 	void	RemoveUnreferencedHunks(std::vector<Hunk*> startHunks);
 
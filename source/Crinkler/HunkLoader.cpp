@@ -1,9 +0,0 @@
-#include <cassert>
-#include "MemoryFile.h"
-#include "HunkLoader.h"
-
-HunkList* HunkLoader::LoadFromFile(const char* filename) {
-	MemoryFile mf(filename);
-
-	return Load(mf.GetPtr(), mf.GetSize(), filename);
-}
\ No newline at end of file
@@ -8,8 +8,9 @@ public:
 	virtual ~HunkLoader() {};
 
 	virtual bool		Clicks(const char* data, int size) const = 0;
+
+	// The loaded hunks may reference the data, which must stay valid while they exist
 	virtual HunkList*	Load(const char* data, int size, const char* module) = 0;
-	HunkList*			LoadFromFile(const char* filename);
 };
 
 #endif
@@ -10,6 +10,8 @@
 
 #include <vector>
 #include <set>
+#include <unordered_map>
+#include <algorithm>
 #include <ppl.h>
 #include <cassert>
 
@@ -17,92 +19,145 @@ using namespace std;
 
 const char *LoadDLL(const char *name);
 
-static unsigned int RVAToFileOffset(const char* module, unsigned int rva)
-{
-	const IMAGE_DOS_HEADER* pDH = (const PIMAGE_DOS_HEADER)module;
-	const IMAGE_NT_HEADERS32* pNTH = (const PIMAGE_NT_HEADERS32)(module + pDH->e_lfanew);
-	int numSections = pNTH->FileHeader.NumberOfSections;
-	int numDataDirectories = pNTH->OptionalHeader.NumberOfRvaAndSizes;
-	const IMAGE_SECTION_HEADER* sectionHeaders = (const IMAGE_SECTION_HEADER*)&pNTH->OptionalHeader.DataDirectory[numDataDirectories];
-	for(int i = 0; i < numSections; i++)
-	{
-		if(rva >= sectionHeaders[i].VirtualAddress && rva < sectionHeaders[i].VirtualAddress + sectionHeaders[i].SizeOfRawData)
-		{
-			return rva - sectionHeaders[i].VirtualAddress + sectionHeaders[i].PointerToRawData;
+// Hashing of C strings by content, for maps keyed by names that outlive the map
+struct NameHash {
+	size_t operator()(const char* name) const {
+		size_t hash = 0;
+		while(*name)
+			hash = hash * 31 + (unsigned char)*name++;
+		return hash;
+	}
+};
+struct NameEqual {
+	bool operator()(const char* a, const char* b) const	{ return strcmp(a, b) == 0; }
+};
+
+// Export table of a DLL, parsed once and indexed by name
+class DllExports {
+	struct Section {
+		unsigned int	virtualAddress;
+		unsigned int	end;
+		unsigned int	pointerToRawData;
+	};
+
+	string						m_dll;
+	const char*					m_module;
+	bool						m_hasExportTable;
+	vector<Section>				m_sections;		// Sorted by virtual address
+	vector<const char*>			m_names;		// In name table order, pointing into the mapped DLL
+	unordered_map<const char*, int, NameHash, NameEqual>	m_nameIndex;	// Index into name table
+
+	vector<int>					m_ordinals;		// Per name
+	vector<const char*>			m_forwards;		// Forwarder string per name, or NULL
+
+public:
+	DllExports(const char* dll) : m_dll(dll), m_module(LoadDLL(dll)) {
+		const IMAGE_DOS_HEADER* pDH = (const PIMAGE_DOS_HEADER)m_module;
+		const IMAGE_NT_HEADERS32* pNTH = (const PIMAGE_NT_HEADERS32)(m_module + pDH->e_lfanew);
+
+		// Section map for RVA translation
+		int numSections = pNTH->FileHeader.NumberOfSections;
+		int numDataDirectories = pNTH->OptionalHeader.NumberOfRvaAndSizes;
+		const IMAGE_SECTION_HEADER* sectionHeaders = (const IMAGE_SECTION_HEADER*)&pNTH->OptionalHeader.DataDirectory[numDataDirectories];
+		for(int i = 0; i < numSections; i++) {
+			Section section = { sectionHeaders[i].VirtualAddress, sectionHeaders[i].VirtualAddress + sectionHeaders[i].SizeOfRawData, sectionHeaders[i].PointerToRawData };
+			if(section.end > section.virtualAddress)
+				m_sections.push_back(section);
+		}
+		std::stable_sort(m_sections.begin(), m_sections.end(), [](const Section& a, const Section& b) { return a.virtualAddress < b.virtualAddress; });
+
+		const IMAGE_DATA_DIRECTORY& exportDirectory = pNTH->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+		m_hasExportTable = exportDirectory.VirtualAddress != 0;
+		if(!m_hasExportTable)
+			return;
+		const IMAGE_EXPORT_DIRECTORY* pIED = (const IMAGE_EXPORT_DIRECTORY*)GetPtr(exportDirectory.VirtualAddress);
+
+		const WORD* ordinalTable = (const WORD*)GetPtr(pIED->AddressOfNameOrdinals);
+		const DWORD* namePointerTable = (const DWORD*)GetPtr(pIED->AddressOfNames);
+		const DWORD* addressTable = (const DWORD*)GetPtr(pIED->AddressOfFunctions);
+
+		int numNames = pIED->NumberOfNames;
+		m_names.resize(numNames);
+		m_ordinals.resize(numNames);
+		m_forwards.resize(numNames);
+		m_nameIndex.reserve(numNames);
+		for(int i = 0; i < numNames; i++) {
+			WORD ordinal = ordinalTable[i];
+			m_names[i] = GetPtr(namePointerTable[i]);
+			m_ordinals[i] = ordinal + pIED->Base;
+
+			// An address inside the export directory is a forwarder string
+			DWORD address = addressTable[ordinal];
+			bool isForward = address >= exportDirectory.VirtualAddress && address < exportDirectory.VirtualAddress + exportDirectory.Size;
+			m_forwards[i] = isForward ? GetPtr(address) : NULL;
+
+			// The first of several equal names is used
+			m_nameIndex.insert(make_pair(m_names[i], i));
 		}
 	}
-	return rva;
-}
 
-static int GetOrdinal(const char* function, const char* dll) {
-	const char* module = LoadDLL(dll);
+	const char* GetPtr(unsigned int rva) const {
+		auto it = std::upper_bound(m_sections.begin(), m_sections.end(), rva, [](unsigned int rva, const Section& s) { return rva < s.virtualAddress; });
+		if(it != m_sections.begin() && rva < (--it)->end)
+			return m_module + (rva - it->virtualAddress + it->pointerToRawData);
+		return m_module + rva;
+	}
 
-	const IMAGE_DOS_HEADER* dh = (const IMAGE_DOS_HEADER*)module;
-	const IMAGE_FILE_HEADER* coffHeader = (const IMAGE_FILE_HEADER*)(module + dh->e_lfanew + 4);
-	const IMAGE_OPTIONAL_HEADER32* pe = (const IMAGE_OPTIONAL_HEADER32*)(coffHeader + 1);
-	const IMAGE_EXPORT_DIRECTORY* exportdir = (const IMAGE_EXPORT_DIRECTORY*) (module + RVAToFileOffset(module, pe->DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress));
-	
-	const short* ordinalTable = (const short*) (module + RVAToFileOffset(module, exportdir->AddressOfNameOrdinals));
-	const int* nameTable = (const int*)(module + RVAToFileOffset(module, exportdir->AddressOfNames));
-	for(int i = 0; i < (int)exportdir->NumberOfNames; i++) {
-		int ordinal = ordinalTable[i] + exportdir->Base;
-		const char* name = module + RVAToFileOffset(module, nameTable[i]);
-		if(strcmp(name, function) == 0) {
-			return ordinal;
-		}
+	const char*					GetDll() const				{ return m_dll.c_str(); }
+	bool						HasExportTable() const		{ return m_hasExportTable; }
+	const vector<const char*>&	GetNames() const			{ return m_names; }
+
+	// Index of a name in the name table, or -1 if it is not exported
+	int FindName(const char* name) const {
+		auto it = m_nameIndex.find(name);
+		return it != m_nameIndex.end() ? it->second : -1;
 	}
 
-	Log::Error("", "Import '%s' cannot be found in '%s'", function, dll);
-	return -1;
+	int			GetOrdinal(int index) const			{ return m_ordinals[index]; }
+	const char*	GetForward(int index) const			{ return m_forwards[index]; }
+};
+
+static const DllExports& GetDllExports(const char* dll) {
+	// Keyed by the name owned by the exports, so a lookup allocates nothing
+	static unordered_map<const char*, DllExports*, NameHash, NameEqual> dllExports;
+	auto it = dllExports.find(dll);
+	if(it == dllExports.end()) {
+		DllExports* exports = new DllExports(dll);
+		it = dllExports.insert(make_pair(exports->GetDll(), exports)).first;
+	}
+	return *it->second;
 }
 
-void ForEachExportInDLL(const char *dll, std::function<void (const char*)> fun) {
-	const char* module = LoadDLL(dll);
-
-	const IMAGE_DOS_HEADER* dh = (const IMAGE_DOS_HEADER*)module;
-	const IMAGE_FILE_HEADER* coffHeader = (const IMAGE_FILE_HEADER*)(module + dh->e_lfanew + 4);
-	const IMAGE_OPTIONAL_HEADER32* pe = (const IMAGE_OPTIONAL_HEADER32*)(coffHeader + 1);
-	const IMAGE_EXPORT_DIRECTORY* exportdir = (const IMAGE_EXPORT_DIRECTORY*)(module + RVAToFileOffset(module, pe->DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress));
+static int GetOrdinal(const char* function, const char* dll) {
+	const DllExports& exports = GetDllExports(dll);
+	int index = exports.FindName(function);
+	if(index == -1) {
+		Log::Error("", "Import '%s' cannot be found in '%s'", function, dll);
+		return -1;
+	}
+	return exports.GetOrdinal(index);
+}
 
-	const int* nameTable = (const int*)(module + RVAToFileOffset(module, exportdir->AddressOfNames));
-	for (int i = 0; i < (int)exportdir->NumberOfNames; i++) {
-		const char* name = module + RVAToFileOffset(module, nameTable[i]);
+void ForEachExportInDLL(const char *dll, std::function<void (const char*)> fun) {
+	for(const char* name : GetDllExports(dll).GetNames()) {
 		fun(name);
 	}
 }
 
 
 static const char *GetForwardRVA(const char* dll, const char* function) {
-	const char* module = LoadDLL(dll);
-	const IMAGE_DOS_HEADER* pDH = (const PIMAGE_DOS_HEADER)module;
-	const IMAGE_NT_HEADERS32* pNTH = (const PIMAGE_NT_HEADERS32)(module + pDH->e_lfanew);
-
-	const DWORD exportRVA = pNTH->OptionalHeader.DataDirectory[0].VirtualAddress;
-	if (exportRVA == 0) {
+	const DllExports& exports = GetDllExports(dll);
+	if (!exports.HasExportTable()) {
 		Log::Error("", "Missing export table in '%s'\n\n"
 			"If running under Wine, copy all imported DLL files from a real Windows to your Wine path.", dll);
 	}
-	const IMAGE_EXPORT_DIRECTORY* pIED = (const PIMAGE_EXPORT_DIRECTORY)(module + RVAToFileOffset(module, exportRVA));
-
-	const short* ordinalTable = (const short*)(module + RVAToFileOffset(module, pIED->AddressOfNameOrdinals));
-	const DWORD* namePointerTable = (const DWORD*)(module + RVAToFileOffset(module, pIED->AddressOfNames));
-	const DWORD* addressTableRVAOffset = (const DWORD*)(module + RVAToFileOffset(module, pIED->AddressOfFunctions));
-
-	for(unsigned int i = 0; i < pIED->NumberOfNames; i++) {
-		short ordinal = ordinalTable[i];
-		const char* name = (const char*)(module + RVAToFileOffset(module, namePointerTable[i]));
-
-		if(strcmp(name, function) == 0) {
-			DWORD address = addressTableRVAOffset[ordinal];
-			if(address >= pNTH->OptionalHeader.DataDirectory[0].VirtualAddress &&
-				address < pNTH->OptionalHeader.DataDirectory[0].VirtualAddress + pNTH->OptionalHeader.DataDirectory[0].Size)
-				return module + RVAToFileOffset(module, address);
-			return NULL;
-		}
-	}
 
-	Log::Error("", "Import '%s' cannot be found in '%s'", function, dll);
-	return false;
+	int index = exports.FindName(function);
+	if(index == -1) {
+		Log::Error("", "Import '%s' cannot be found in '%s'", function, dll);
+		return NULL;
+	}
+	return exports.GetForward(index);
 }
 
 
@@ -257,17 +312,8 @@ static bool FindCollisionFreeHash(vector<string>& dll_names, const vector<Hunk*>
 
 		{
 			// Scrape exports from DLL on this machine
-			const char* module = LoadDLL(dllname);
-
-			const IMAGE_DOS_HEADER* dh = (const IMAGE_DOS_HEADER*)module;
-			const IMAGE_FILE_HEADER* coffHeader = (const IMAGE_FILE_HEADER*)(module + dh->e_lfanew + 4);
-			const IMAGE_OPTIONAL_HEADER32* pe = (const IMAGE_OPTIONAL_HEADER32*)(coffHeader + 1);
-			const IMAGE_EXPORT_DIRECTORY* exportdir = (const IMAGE_EXPORT_DIRECTORY*)(module + RVAToFileOffset(module, pe->DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress));
-			int num_names = exportdir->NumberOfNames;
-			const int* name_table = (const int*)(module + RVAToFileOffset(module, exportdir->AddressOfNames));
-			for(int i = 0; i < num_names; i++)
+			for(const char* name : GetDllExports(dllname).GetNames())
 			{
-				const char* name = module + RVAToFileOffset(module, name_table[i]);
 				info.exports.push_back(name);
 			}
 		}
@@ -0,0 +1,392 @@
+#include "IncrementalLinker.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <string>
+
+#include "HunkList.h"
+#include "Symbol.h"
+#include "Transform.h"
+#include "misc.h"
+
+using namespace std;
+
+IncrementalLinker::IncrementalLinker(Transform& transform, Hunk* detransformer, int baseAddress) :
+	m_transform(transform), m_transformEnabled(transform.IsEnabled()), m_detransformer(detransformer),
+	m_baseAddress(baseAddress), m_flags(0), m_alignmentBits(0)
+{
+}
+
+IncrementalLinker::~IncrementalLinker() {
+	delete m_detransformer;
+}
+
+IncrementalLinker* IncrementalLinker::Create(HunkList* hunklist, Transform& transform, Symbol* entry_label, int baseAddress) {
+	IncrementalLinker* linker = new IncrementalLinker(transform, transform.CreateDetransformer(), baseAddress);
+
+	linker->m_hunks.resize(hunklist->GetNumHunks() + 1);
+	linker->m_hunks[0].hunk = linker->m_detransformer;
+	for(int i = 0; i < hunklist->GetNumHunks(); i++) {
+		linker->m_hunks[i + 1].hunk = (*hunklist)[i];
+	}
+
+	if(!linker->Bind(entry_label)) {
+		delete linker;
+		return nullptr;
+	}
+
+	linker->SetBase(hunklist);
+	return linker;
+}
+
+bool IncrementalLinker::Bind(Symbol* entry_label) {
+	m_detransformer->SetContinuation(entry_label);
+
+	for(int i = 0; i < (int)m_hunks.size(); i++) {
+		const Hunk* h = m_hunks[i].hunk;
+		if(!m_hunkIndex.insert(make_pair(h, i)).second) {
+			return false;
+		}
+		m_alignmentBits = max(m_alignmentBits, h->GetAlignmentBits());
+		m_flags |= h->GetFlags() & (HUNK_IS_CODE | HUNK_IS_WRITEABLE);
+	}
+
+	// Collect definitions the way HunkList::ToHunk merges symbols:
+	// the first non-weak definition wins, otherwise the last weak one.
+	struct Definition {
+		Symbol*	symbol;
+		int		hunk;
+		int		numStrong;
+		int		numWeak;
+	};
+	unordered_map<PooledString, Definition, PooledString::Hash> definitions;
+	for(int i = 0; i < (int)m_hunks.size(); i++) {
+		for(const auto& p : m_hunks[i].hunk->m_symbols) {
+			Symbol* s = p.second;
+			Definition& d = definitions.insert(make_pair(p.first, Definition { nullptr, -1, 0, 0 })).first->second;
+			if(s->secondaryName.empty()) {
+				if(d.numStrong++ == 0) {
+					d.symbol = s;
+					d.hunk = i;
+				}
+			} else {
+				d.numWeak++;
+				if(d.numStrong == 0) {
+					d.symbol = s;
+					d.hunk = i;
+				}
+			}
+		}
+	}
+
+	// Definitions that depend on hunk order cannot be bound
+	auto resolve = [&definitions](const PooledString& name) -> const Definition* {
+		auto it = definitions.find(name);
+		if(it == definitions.end())
+			return nullptr;
+		const Definition& d = it->second;
+		if(d.numStrong > 1 || (d.numStrong == 0 && d.numWeak > 1))
+			return nullptr;
+		return &d;
+	};
+
+	auto bind = [&resolve](const PooledString& name, int offset, RelocationType type, BoundRelocation& relocation) {
+		const Definition* d = resolve(name);
+		if(d && !d->symbol->secondaryName.empty())
+			d = resolve(d->symbol->secondaryName);
+		if(d == nullptr)
+			return false;
+
+		relocation.offset = offset;
+		relocation.type = type;
+		relocation.target = (d->symbol->flags & SYMBOL_IS_RELOCATEABLE) ? d->hunk : -1;
+		relocation.value = d->symbol->value;
+		return true;
+	};
+
+	for(int i = 0; i < (int)m_hunks.size(); i++) {
+		HunkInfo& info = m_hunks[i];
+		const Hunk* h = info.hunk;
+
+		info.relocationsEnd = 0;
+		info.relocations.resize(h->m_relocations.size());
+		for(int r = 0; r < (int)h->m_relocations.size(); r++) {
+			const Relocation& relocation = h->m_relocations[r];
+			if(!bind(relocation.symbolname, relocation.offset, relocation.type, info.relocations[r])) {
+				return false;
+			}
+			info.relocationsEnd = max(info.relocationsEnd, relocation.offset + 4);
+		}
+
+		// Relocations are reapplied to the original bytes, so they must not overlap
+		vector<int> offsets;
+		for(const BoundRelocation& relocation : info.relocations) {
+			offsets.push_back(relocation.offset);
+		}
+		sort(offsets.begin(), offsets.end());
+		for(int r = 1; r < (int)offsets.size(); r++) {
+			if(offsets[r] - offsets[r - 1] < 4) {
+				return false;
+			}
+		}
+
+		Symbol* cont = h->GetContinuation();
+		info.hasContinuation = cont != nullptr;
+		info.continuationHunk = -1;
+		info.continuationAtStart = false;
+		if(cont) {
+			auto it = m_hunkIndex.find(cont->hunk);
+			if(it != m_hunkIndex.end()) {
+				info.continuationHunk = it->second;
+			}
+			info.continuationAtStart = !(cont->value > 0);
+			if(!bind(cont->name, h->GetRawSize() + 1, RELOCTYPE_REL32, info.continuationJump)) {
+				return false;
+			}
+		}
+	}
+
+	// Index relocations by target, for repatching when the target moves
+	for(int i = 0; i < (int)m_hunks.size(); i++) {
+		HunkInfo& info = m_hunks[i];
+		for(int r = 0; r < (int)info.relocations.size(); r++) {
+			if(info.relocations[r].target != -1) {
+				m_hunks[info.relocations[r].target].incoming.push_back(IncomingRelocation { i, r });
+			}
+		}
+		if(info.hasContinuation && info.continuationJump.target != -1) {
+			m_hunks[info.continuationJump.target].incoming.push_back(IncomingRelocation { i, -1 });
+		}
+	}
+
+	return true;
+}
+
+bool IncrementalLinker::GetOrder(const HunkList* hunklist, vector<int>& order) const {
+	if(hunklist->GetNumHunks() + 1 != (int)m_hunks.size())
+		return false;
+
+	vector<bool> seen(m_hunks.size(), false);
+	order.resize(m_hunks.size());
+	order[0] = 0;
+	seen[0] = true;
+	for(int i = 0; i < hunklist->GetNumHunks(); i++) {
+		auto it = m_hunkIndex.find((*hunklist)[i]);
+		if(it == m_hunkIndex.end() || seen[it->second])
+			return false;
+		seen[it->second] = true;
+		order[i + 1] = it->second;
+	}
+	return true;
+}
+
+// Same layout as HunkList::ToHunk
+void IncrementalLinker::ComputeLayout(Layout& layout) const {
+	int n = (int)layout.order.size();
+	layout.address.resize(n);
+	layout.jump.resize(n);
+	layout.splittingPoint = -1;
+	layout.relocationsEnd = 0;
+
+	int rawsize = 0;
+	int virtualsize = 0;
+	int address = 0;
+	bool overflow = false;
+	for(int pos = 0; pos < n; pos++) {
+		const HunkInfo& info = m_hunks[layout.order[pos]];
+		const Hunk* h = info.hunk;
+
+		virtualsize += m_baseAddress - h->GetAlignmentOffset();
+		virtualsize = Align(virtualsize, h->GetAlignmentBits());
+		virtualsize -= m_baseAddress - h->GetAlignmentOffset();
+		if(virtualsize < 0) overflow = true;
+
+		if(h->GetRawSize() > 0)
+			rawsize = virtualsize + h->GetRawSize();
+		virtualsize += h->GetVirtualSize();
+		if(virtualsize < 0) overflow = true;
+
+		bool jump = info.hasContinuation &&
+			(!info.continuationAtStart || pos + 1 == n || layout.order[pos + 1] != info.continuationHunk);
+		if(jump) {
+			rawsize += 5;
+			virtualsize = rawsize;
+		}
+		if(virtualsize < 0) overflow = true;
+
+		address += m_baseAddress - h->GetAlignmentOffset();
+		address = Align(address, h->GetAlignmentBits());
+		address -= m_baseAddress - h->GetAlignmentOffset();
+
+		layout.address[pos] = address;
+		layout.jump[pos] = jump;
+		if(layout.splittingPoint == -1 && !(h->GetFlags() & HUNK_IS_CODE))
+			layout.splittingPoint = address;
+		if(!info.relocations.empty())
+			layout.relocationsEnd = max(layout.relocationsEnd, address + info.relocationsEnd);
+
+		if(jump) {
+			address += h->GetRawSize() + 5;
+			layout.relocationsEnd = max(layout.relocationsEnd, address);
+		} else {
+			address += h->GetVirtualSize();
+		}
+	}
+
+	layout.rawsize = overflow ? -1 : rawsize;
+	layout.virtualsize = virtualsize;
+}
+
+void IncrementalLinker::Relocate(char* image, const vector<int>& hunkAddress, int source, int relocation) const {
+	const HunkInfo& info = m_hunks[source];
+	const BoundRelocation& r = relocation == -1 ? info.continuationJump : info.relocations[relocation];
+
+	int address = hunkAddress[source] + r.offset;
+	int word = relocation == -1 ? 0 : *(const int*)&info.hunk->GetData()[r.offset];
+	int value = r.value;
+	if(r.target != -1)
+		value += hunkAddress[r.target];
+
+	switch(r.type) {
+		case RELOCTYPE_ABS32:
+			word += value;
+			if(r.target != -1)
+				word += m_baseAddress;
+			break;
+		case RELOCTYPE_REL32:
+			word += value - address - 4;
+			break;
+	}
+	*(int*)&image[address] = word;
+}
+
+// Rebuild the image from the end of the hunk before first up to the start of the hunk after last
+void IncrementalLinker::CopyHunks(char* image, const Layout& layout, const vector<int>& hunkAddress, int first, int last) const {
+	int n = (int)layout.order.size();
+	int start = 0;
+	if(first > 0) {
+		const Hunk* prev = m_hunks[layout.order[first - 1]].hunk;
+		start = layout.address[first - 1] + prev->GetRawSize() + (layout.jump[first - 1] ? 5 : 0);
+	}
+	int end = last + 1 < n ? layout.address[last + 1] : layout.rawsize;
+	end = min(end, layout.rawsize);
+	if(end > start)
+		memset(&image[start], 0, end - start);
+
+	for(int pos = first; pos <= last; pos++) {
+		int index = layout.order[pos];
+		const HunkInfo& info = m_hunks[index];
+		int address = layout.address[pos];
+		int rawsize = info.hunk->GetRawSize();
+
+		if(rawsize > 0)
+			memcpy(&image[address], info.hunk->GetData(), rawsize);
+		for(int r = 0; r < (int)info.relocations.size(); r++) {
+			Relocate(image, hunkAddress, index, r);
+		}
+		if(layout.jump[pos]) {
+			image[address + rawsize] = (char)0xE9;
+			Relocate(image, hunkAddress, index, -1);
+		}
+	}
+}
+
+void IncrementalLinker::SetBase(const HunkList* hunklist) {
+	bool valid = GetOrder(hunklist, m_base.order);
+	assert(valid);
+	ComputeLayout(m_base);
+	assert(m_base.rawsize >= 0);
+
+	m_baseHunkAddress.resize(m_hunks.size());
+	for(int pos = 0; pos < (int)m_base.order.size(); pos++) {
+		m_baseHunkAddress[m_base.order[pos]] = m_base.address[pos];
+	}
+
+	m_baseImage.assign(m_base.rawsize, 0);
+	CopyHunks(m_baseImage.data(), m_base, m_baseHunkAddress, 0, (int)m_base.order.size() - 1);
+}
+
+bool IncrementalLinker::GetHunkOffsets(const HunkList* hunklist, vector<int>& offsets) const {
+	Layout layout;
+	if(!GetOrder(hunklist, layout.order))
+		return false;
+	ComputeLayout(layout);
+
+	// Skip the detransformer
+	offsets.assign(layout.address.begin() + 1, layout.address.end());
+	return true;
+}
+
+Hunk* IncrementalLinker::Link(const HunkList* hunklist, int* splittingPoint) const {
+	Layout layout;
+	if(!GetOrder(hunklist, layout.order))
+		return nullptr;
+	ComputeLayout(layout);
+	if(layout.rawsize < 0)
+		return nullptr;
+
+	int n = (int)layout.order.size();
+	vector<int> hunkAddress(m_hunks.size());
+	for(int pos = 0; pos < n; pos++) {
+		hunkAddress[layout.order[pos]] = layout.address[pos];
+	}
+
+	Hunk* linked = new Hunk("linked", nullptr, m_flags, m_alignmentBits, layout.rawsize, layout.virtualsize);
+	char* image = linked->GetPtr();
+	memcpy(image, m_baseImage.data(), min(layout.rawsize, m_base.rawsize));
+
+	// Positions outside [first, last] are unchanged from the base image
+	auto unchanged = [&](int pos) {
+		return layout.order[pos] == m_base.order[pos] &&
+			layout.address[pos] == m_base.address[pos] &&
+			layout.jump[pos] == m_base.jump[pos];
+	};
+	int first = 0;
+	while(first < n && unchanged(first))
+		first++;
+
+	if(first < n) {
+		int last = n - 1;
+		while(unchanged(last))
+			last--;
+
+		CopyHunks(image, layout, hunkAddress, first, last);
+
+		// Repatch relocations from unchanged hunks into moved hunks
+		vector<bool> copied(m_hunks.size(), false);
+		for(int pos = first; pos <= last; pos++) {
+			copied[layout.order[pos]] = true;
+		}
+		for(int pos = first; pos <= last; pos++) {
+			int index = layout.order[pos];
+			if(hunkAddress[index] == m_baseHunkAddress[index])
+				continue;
+			for(const IncomingRelocation& incoming : m_hunks[index].incoming) {
+				if(!copied[incoming.source])
+					Relocate(image, hunkAddress, incoming.source, incoming.relocation);
+			}
+		}
+	}
+
+	// Trim like Hunk::Trim
+	int size = layout.rawsize;
+	while(size > layout.relocationsEnd && image[size - 1] == 0)
+		size--;
+	linked->SetRawSize(size);
+
+	// The transform only needs the symbols of the detransformer, which is always first
+	for(const auto& p : m_detransformer->m_symbols) {
+		Symbol* s = new Symbol(*p.second);
+		s->hunk = linked;
+		linked->AddSymbol(s);
+	}
+
+	if(splittingPoint)
+		*splittingPoint = layout.splittingPoint;
+
+	if(m_transformEnabled)
+		m_transform.DoTransform(linked, layout.splittingPoint, false);
+
+	return linked;
+}
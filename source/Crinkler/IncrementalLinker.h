@@ -0,0 +1,91 @@
+#pragma once
+#ifndef _INCREMENTAL_LINKER_H_
+#define _INCREMENTAL_LINKER_H_
+
+#include <vector>
+#include <unordered_map>
+
+#include "Hunk.h"
+
+class HunkList;
+class Symbol;
+class Transform;
+
+// Relinks permutations of a fixed set of hunks against a previously linked image.
+// Relocations are bound to hunks once, and only the hunks between the first and last
+// changed position are copied again. Relocations from other hunks are repatched only
+// if their target moved. The result is identical to Transform::LinkAndTransform.
+class IncrementalLinker {
+	struct BoundRelocation {
+		int				offset;			// Offset in source hunk
+		RelocationType	type;
+		int				target;			// Index of target hunk, or -1 for absolute symbols
+		int				value;			// Symbol value, relative to target hunk if target != -1
+	};
+
+	struct IncomingRelocation {
+		int				source;			// Index of source hunk
+		int				relocation;		// Index into source hunk relocations, or -1 for continuation jump
+	};
+
+	struct HunkInfo {
+		Hunk*								hunk;
+		std::vector<BoundRelocation>		relocations;
+		std::vector<IncomingRelocation>		incoming;
+		int									relocationsEnd;		// End of last relocated dword
+		int									continuationHunk;	// Hunk index of continuation symbol, or -1
+		bool								hasContinuation;
+		bool								continuationAtStart;	// Continuation symbol is at offset 0 of its hunk
+		BoundRelocation						continuationJump;
+	};
+
+	struct Layout {
+		std::vector<int>	order;			// Hunk indices in link order
+		std::vector<int>	address;		// Address per position
+		std::vector<bool>	jump;			// Continuation jump after hunk, per position
+		int					rawsize;
+		int					virtualsize;
+		int					splittingPoint;
+		int					relocationsEnd;
+	};
+
+	const Transform&						m_transform;
+	bool									m_transformEnabled;
+	Hunk*									m_detransformer;
+	int										m_baseAddress;
+	unsigned int							m_flags;
+	int										m_alignmentBits;
+	std::vector<HunkInfo>					m_hunks;			// Index 0 is the detransformer
+	std::unordered_map<const Hunk*, int>	m_hunkIndex;
+
+	Layout									m_base;
+	std::vector<char>						m_baseImage;		// Untrimmed, untransformed image of m_base
+	std::vector<int>						m_baseHunkAddress;	// Address per hunk index
+
+	IncrementalLinker(Transform& transform, Hunk* detransformer, int baseAddress);
+
+	bool	Bind(Symbol* entry_label);
+	bool	GetOrder(const HunkList* hunklist, std::vector<int>& order) const;
+	void	ComputeLayout(Layout& layout) const;
+	void	Relocate(char* image, const std::vector<int>& hunkAddress, int source, int relocation) const;
+	void	CopyHunks(char* image, const Layout& layout, const std::vector<int>& hunkAddress, int first, int last) const;
+public:
+	~IncrementalLinker();
+
+	// Returns nullptr if the hunk list cannot be relinked incrementally, e.g. when
+	// symbol resolution depends on hunk order or a symbol is missing.
+	static IncrementalLinker* Create(HunkList* hunklist, Transform& transform, Symbol* entry_label, int baseAddress);
+
+	// Link and transform a permutation of the hunks. Can be called concurrently.
+	// Returns nullptr if the result would differ from a full link.
+	Hunk*	Link(const HunkList* hunklist, int* splittingPoint) const;
+
+	// Make the order of the hunk list the base for subsequent links
+	void	SetBase(const HunkList* hunklist);
+
+	// Offset in the linked image of each hunk of the hunk list, in list order.
+	// Returns false if the hunk list is not a permutation of the linked hunks.
+	bool	GetHunkOffsets(const HunkList* hunklist, std::vector<int>& offsets) const;
+};
+
+#endif
@@ -0,0 +1,435 @@
+#include "LibraryCache.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "Hunk.h"
+#include "HunkList.h"
+#include "Log.h"
+#include "MemoryFile.h"
+#include "NameMangling.h"
+#include "Symbol.h"
+
+using namespace std;
+
+// A cache file consists of
+//  - the header,
+//  - the build and module names,
+//  - the entry and name of each symbol in the library symbol index,
+//  - the order key, flags and file offset of each entry,
+//  - the hunks loaded for each entry.
+// Strings are zero terminated. Hunk data is stored in place and shared by the loaded hunks.
+
+static const char CACHE_MAGIC[8] = { 'C', 'R', 'I', 'N', 'K', 'L', 'I', 'B' };
+static const int CACHE_FORMAT_VERSION = 2;
+
+// Entry flags
+static const int ENTRY_HAS_INITIALIZERS = 1;
+static const int ENTRY_SIZE = 3 * sizeof(int);
+
+struct CacheHeader {
+	char				magic[8];
+	int					formatVersion;
+	int					fileSize;		// Size of the complete file, to detect incomplete writes
+	unsigned long long	libraryHash;
+	int					librarySize;
+	int					numSymbols;
+	int					numEntries;
+};
+
+struct LibraryCache::Writer {
+	vector<char>	data;
+
+	int		GetPos() const							{ return (int)data.size(); }
+	void	PutData(const void* ptr, int size)		{ data.insert(data.end(), (const char*)ptr, (const char*)ptr + size); }
+	void	PutInt(int v)							{ PutData(&v, sizeof(int)); }
+	void	PutString(const char* str)				{ PutData(str, (int)strlen(str) + 1); }
+	void	SetInt(int pos, int v)					{ memcpy(&data[pos], &v, sizeof(int)); }
+};
+
+// Reads past the end of the data fail, after which all reads return empty values
+struct LibraryCache::Reader {
+	const char*		ptr;
+	const char*		end;
+	bool			failed;
+
+	int	GetRemaining() const						{ return int(end - ptr); }
+
+	const char* ReadData(int size) {
+		if(size < 0 || size > GetRemaining()) {
+			failed = true;
+			ptr = end;
+			return NULL;
+		}
+		const char* d = ptr;
+		ptr += size;
+		return d;
+	}
+
+	int ReadInt() {
+		int v = 0;
+		if(const char* d = ReadData(sizeof(int)))
+			memcpy(&v, d, sizeof(int));
+		return v;
+	}
+
+	const char* ReadString() {
+		const char* terminator = ptr < end ? (const char*)memchr(ptr, 0, end - ptr) : NULL;
+		if(terminator == NULL) {
+			failed = true;
+			ptr = end;
+			return "";
+		}
+		return ReadData(int(terminator - ptr) + 1);
+	}
+};
+
+// 64-bit FNV-1a
+static unsigned long long HashData(const char* data, int size, unsigned long long hash = 14695981039346656037ULL) {
+	for(int i = 0; i < size; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+LibraryCache::LibraryCache(const char* directory, const char* build) :
+	m_directory(directory), m_build(build)
+{
+	if(!m_directory.empty() && m_directory.back() != '\\' && m_directory.back() != '/')
+		m_directory += "\\";
+}
+
+unsigned long long LibraryCache::HashLibrary(const char* data, int size) {
+	return HashData(data, size);
+}
+
+string LibraryCache::GetFilename(const char* module, unsigned long long hash) const {
+	unsigned long long key = HashData(module, (int)strlen(module), hash);
+	key = HashData(m_build.c_str(), (int)m_build.size(), key);
+
+	char name[32];
+	sprintf_s(name, sizeof(name), "%016llx.crlib", key);
+	return m_directory + name;
+}
+
+void LibraryCache::WriteHunks(Writer& out, HunkList* hunklist) {
+	out.PutInt(hunklist->GetNumHunks());
+	for(int i = 0; i < hunklist->GetNumHunks(); i++) {
+		// Loaded hunks have no continuation
+		const Hunk* hunk = (*hunklist)[i];
+		out.PutString(hunk->GetName());
+		out.PutInt(hunk->GetFlags());
+		out.PutInt(hunk->GetAlignmentBits());
+		out.PutInt(hunk->GetAlignmentOffset());
+		out.PutInt(hunk->GetVirtualSize());
+		out.PutInt(hunk->GetRawSize());
+		out.PutData(hunk->GetData(), hunk->GetRawSize());
+		out.PutString(hunk->GetImportName());
+		out.PutString(hunk->GetImportDll());
+
+		out.PutInt((int)hunk->m_symbols.size());
+		for(const auto& p : hunk->m_symbols) {
+			const Symbol* s = p.second;
+			out.PutString(s->name.c_str());
+			out.PutString(s->secondaryName.c_str());
+			out.PutString(s->miscString.c_str());
+			out.PutInt(s->value);
+			out.PutInt(s->flags);
+			out.PutInt(s->size);
+			out.PutInt(s->hunk_offset);
+		}
+
+		out.PutInt((int)hunk->m_relocations.size());
+		for(const Relocation& r : hunk->m_relocations) {
+			out.PutString(r.symbolname.c_str());
+			out.PutInt(r.offset);
+			out.PutInt(r.type);
+			out.PutString(r.objectname.c_str());
+		}
+	}
+}
+
+bool LibraryCache::ReadHunks(Reader& in, HunkList* hunklist) {
+	int numHunks = in.ReadInt();
+	for(int i = 0; i < numHunks && !in.failed; i++) {
+		const char* name = in.ReadString();
+		unsigned int flags = in.ReadInt();
+		int alignmentBits = in.ReadInt();
+		int alignmentOffset = in.ReadInt();
+		int virtualsize = in.ReadInt();
+		int rawsize = in.ReadInt();
+		const char* data = in.ReadData(rawsize);
+		const char* importName = in.ReadString();
+		const char* importDll = in.ReadString();
+		if(in.failed || virtualsize < rawsize)
+			return false;
+
+		Hunk* hunk = NULL;
+		if(hunklist) {
+			hunk = new Hunk(name, data, flags, alignmentBits, rawsize, virtualsize, true);
+			hunk->SetAlignmentOffset(alignmentOffset);
+			hunk->m_importName = importName;
+			hunk->m_importDll = importDll;
+			hunklist->AddHunkBack(hunk);
+		}
+
+		int numSymbols = in.ReadInt();
+		for(int j = 0; j < numSymbols && !in.failed; j++) {
+			const char* symbolName = in.ReadString();
+			const char* secondaryName = in.ReadString();
+			const char* miscString = in.ReadString();
+			int value = in.ReadInt();
+			unsigned int symbolFlags = in.ReadInt();
+			int size = in.ReadInt();
+			int hunkOffset = in.ReadInt();
+			if(hunk && !in.failed) {
+				Symbol* s = new Symbol(symbolName, value, symbolFlags, hunk, miscString);
+				s->secondaryName = secondaryName;
+				s->size = size;
+				s->hunk_offset = hunkOffset;
+				hunk->AddSymbol(s);
+			}
+		}
+
+		int numRelocations = in.ReadInt();
+		for(int j = 0; j < numRelocations && !in.failed; j++) {
+			Relocation r;
+			r.symbolname = in.ReadString();
+			r.offset = in.ReadInt();
+			r.type = (RelocationType)in.ReadInt();
+			r.objectname = in.ReadString();
+			if(r.offset < 0 || r.offset > rawsize - 4)
+				return false;
+			if(hunk && !in.failed)
+				hunk->AddRelocation(r);
+		}
+	}
+	if(hunklist)
+		hunklist->MarkHunksAsLibrary();
+	return !in.failed;
+}
+
+CachedLibrary* LibraryCache::Open(const char* module, int size, unsigned long long hash) const {
+	string filename = GetFilename(module, hash);
+	CachedLibrary* library = new CachedLibrary(new MemoryFile(filename.c_str(), false, true));
+	if(!library->Read(m_build.c_str(), module, size, hash)) {
+		delete library;
+		return NULL;
+	}
+	return library;
+}
+
+bool LibraryCache::Write(const CoffLibrary& library, unsigned long long hash) const {
+	const char* module = library.GetModule();
+	string filename = GetFilename(module, hash);
+
+	// Symbols loading the same hunks share an entry
+	int numSymbols = library.GetNumSymbols();
+	vector<int> symbolEntries(numSymbols, -1);
+	vector<int> entrySymbols;
+	unordered_map<int, int> orderEntries;
+	auto getEntry = [&](int symbol) {
+		auto it = orderEntries.insert(make_pair(library.GetSymbolOrder(symbol), (int)entrySymbols.size())).first;
+		if(it->second == (int)entrySymbols.size())
+			entrySymbols.push_back(symbol);
+		return it->second;
+	};
+	for(int i = 0; i < numSymbols; i++) {
+		if(library.GetSymbolOrder(i) != -1)
+			symbolEntries[i] = getEntry(i);
+	}
+
+	// Members with dynamic initializers get an entry even if no symbol refers to them
+	vector<int> entryFlags(entrySymbols.size(), 0);
+	for(int symbol : library.GetInitializerSymbols()) {
+		int entry = getEntry(symbol);
+		entryFlags.resize(entrySymbols.size(), 0);
+		entryFlags[entry] |= ENTRY_HAS_INITIALIZERS;
+	}
+	int numEntries = (int)entrySymbols.size();
+
+	Writer out;
+	CacheHeader header = {};
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.formatVersion = CACHE_FORMAT_VERSION;
+	header.libraryHash = hash;
+	header.librarySize = library.GetSize();
+	header.numSymbols = numSymbols;
+	header.numEntries = numEntries;
+	out.PutData(&header, sizeof(header));
+	out.PutString(m_build.c_str());
+	out.PutString(module);
+
+	for(int i = 0; i < numSymbols; i++) {
+		out.PutInt(symbolEntries[i]);
+		out.PutString(library.GetSymbolName(i));
+	}
+
+	int entriesPos = out.GetPos();
+	for(int e = 0; e < numEntries; e++) {
+		out.PutInt(0);
+		out.PutInt(entryFlags[e]);
+		out.PutInt(0);
+	}
+
+	for(int e = 0; e < numEntries; e++) {
+		int order;
+		HunkList* hunklist = library.LoadSymbol(entrySymbols[e], &order);
+		out.SetInt(entriesPos + e * ENTRY_SIZE, order);
+		out.SetInt(entriesPos + e * ENTRY_SIZE + 2 * sizeof(int), out.GetPos());
+		WriteHunks(out, hunklist);
+		delete hunklist;
+	}
+	out.SetInt(offsetof(CacheHeader, fileSize), out.GetPos());
+
+	// Write to a file private to this writer, and replace the cache file only when complete
+	static atomic<int> tempCounter(0);
+	char tempSuffix[32];
+#ifdef WIN32
+	sprintf_s(tempSuffix, sizeof(tempSuffix), ".%lu.%d.tmp", GetCurrentProcessId(), tempCounter++);
+#else
+	sprintf_s(tempSuffix, sizeof(tempSuffix), ".%d.%d.tmp", (int)getpid(), tempCounter++);
+#endif
+	string tempFilename = filename + tempSuffix;
+
+	FILE* file;
+	if(fopen_s(&file, tempFilename.c_str(), "wb")) {
+		Log::Warning(module, "Cannot write library cache file '%s'", filename.c_str());
+		return false;
+	}
+	bool written = fwrite(out.data.data(), 1, out.data.size(), file) == out.data.size();
+	written = fclose(file) == 0 && written;
+#ifdef WIN32
+	written = written && MoveFileExA(tempFilename.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+	written = written && rename(tempFilename.c_str(), filename.c_str()) == 0;
+#endif
+	if(!written) {
+		remove(tempFilename.c_str());
+		Log::Warning(module, "Cannot write library cache file '%s'", filename.c_str());
+	}
+	return written;
+}
+
+CachedLibrary::CachedLibrary(MemoryFile* file) :
+	m_file(file), m_entries(NULL)
+{
+}
+
+bool CachedLibrary::Read(const char* build, const char* module, int size, unsigned long long hash) {
+	// Check that the file was written for this library by this build
+	const char* data = m_file->GetPtr();
+	const CacheHeader* header = (const CacheHeader*)data;
+	bool valid = m_file->GetSize() >= (int)sizeof(CacheHeader) &&
+		memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+		header->formatVersion == CACHE_FORMAT_VERSION &&
+		header->fileSize == m_file->GetSize() &&
+		header->libraryHash == hash &&
+		header->librarySize == size &&
+		header->numSymbols >= 0 &&
+		header->numEntries >= 0;
+	if(!valid)
+		return false;
+	LibraryCache::Reader in = { data + sizeof(CacheHeader), data + m_file->GetSize(), false };
+	if(strcmp(build, in.ReadString()) != 0 || strcmp(module, in.ReadString()) != 0)
+		return false;
+
+	// Make symbol index
+	int numSymbols = header->numSymbols;
+	int numEntries = header->numEntries;
+	for(int i = 0; i < numSymbols && !in.failed; i++) {
+		int entry = in.ReadInt();
+		const char* name = in.ReadString();
+		if(entry < -1 || entry >= numEntries)
+			return false;
+		m_symbolEntries.push_back(entry);
+		m_symbolNames.push_back(name);
+	}
+	if(numEntries > in.GetRemaining() / ENTRY_SIZE)
+		return false;
+	m_entries = (const int*)in.ReadData(numEntries * ENTRY_SIZE);
+	if(in.failed)
+		return false;
+
+	// Check the hunks of each entry, so that loading them later cannot fail
+	for(int e = 0; e < numEntries; e++) {
+		int offset = m_entries[e * 3 + 2];
+		if(offset < (int)sizeof(CacheHeader) || offset >= m_file->GetSize())
+			return false;
+		LibraryCache::Reader entry = { data + offset, data + m_file->GetSize(), false };
+		if(!LibraryCache::ReadHunks(entry, NULL))
+			return false;
+	}
+
+	m_symbolIndex.reserve(numSymbols);
+	for(int i = 0; i < numSymbols; i++) {
+		if(m_symbolEntries[i] != -1)
+			m_symbolIndex.insert(make_pair(PooledString(m_symbolNames[i]), i));
+	}
+	m_claimedEntries.resize(numEntries, false);
+	return true;
+}
+
+CachedLibrary::~CachedLibrary() {
+	delete m_file;
+}
+
+int CachedLibrary::GetSymbolEntry(int symbol) const {
+	if(symbol >= (int)m_symbolEntries.size())
+		return symbol - (int)m_symbolEntries.size();
+	return m_symbolEntries[symbol];
+}
+
+bool CachedLibrary::ClaimSymbol(const PooledString& name, int& symbol) {
+	auto it = m_symbolIndex.find(name);
+	if(it == m_symbolIndex.end())
+		return false;
+	symbol = it->second;
+	m_symbolIndex.erase(it);
+
+	int entry = m_symbolEntries[symbol];
+	if(m_claimedEntries[entry])
+		symbol = -1;
+	m_claimedEntries[entry] = true;
+	return true;
+}
+
+void CachedLibrary::ClaimInitializers(vector<int>& symbols) {
+	for(int entry = 0; entry < (int)m_claimedEntries.size(); entry++) {
+		if((m_entries[entry * 3 + 1] & ENTRY_HAS_INITIALIZERS) && !m_claimedEntries[entry]) {
+			m_claimedEntries[entry] = true;
+			symbols.push_back((int)m_symbolEntries.size() + entry);
+		}
+	}
+}
+
+HunkList* CachedLibrary::LoadSymbol(int symbol, int* order) const {
+	int entry = GetSymbolEntry(symbol);
+	*order = m_entries[entry * 3];
+	LibraryCache::Reader in = { m_file->GetPtr() + m_entries[entry * 3 + 2], m_file->GetPtr() + m_file->GetSize(), false };
+	HunkList* hunklist = new HunkList;
+	LibraryCache::ReadHunks(in, hunklist);		// Checked when the file was opened
+	return hunklist;
+}
+
+bool CachedLibrary::FindUndecoratedSymbol(const char* name, PooledString& result) const {
+	for(const char* symbolName : m_symbolNames) {
+		if(UndecorateSymbolName(symbolName).compare(name) == 0) {
+			result = symbolName;
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#ifndef _LIBRARY_CACHE_H_
+#define _LIBRARY_CACHE_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "CoffLibraryLoader.h"
+#include "StringPool.h"
+
+class Hunk;
+class HunkList;
+class MemoryFile;
+class CachedLibrary;
+
+// Directory of cache files holding the parsed members of COFF libraries, so that later links
+// can load them without parsing the library again. A cache file is named by a hash of the
+// library contents, the module name and the Crinkler build, and is ignored if any of them differ.
+class LibraryCache {
+	friend class CachedLibrary;
+
+	struct Writer;
+	struct Reader;
+
+	std::string	m_directory;
+	std::string	m_build;
+
+	std::string	GetFilename(const char* module, unsigned long long hash) const;
+
+	static void			WriteHunks(Writer& out, HunkList* hunklist);
+
+	// Read the hunks of an entry into hunklist, or only check them if hunklist is NULL.
+	// Returns false if the data is malformed.
+	static bool			ReadHunks(Reader& in, HunkList* hunklist);
+public:
+	LibraryCache(const char* directory, const char* build);
+
+	// Hash of the library contents, identifying its cache file together with the module name
+	static unsigned long long	HashLibrary(const char* data, int size);
+
+	// Open the cache file of a library. Returns NULL if there is no valid cache file.
+	CachedLibrary*	Open(const char* module, int size, unsigned long long hash) const;
+
+	// Load all members of a library and write them to its cache file. The file is written
+	// under a temporary name and renamed when complete, so readers never see a partial file.
+	bool			Write(const CoffLibrary& library, unsigned long long hash) const;
+};
+
+// Library loaded from a mapped cache file. Hunk data references the file.
+class CachedLibrary : public LazyLibrary {
+	friend class LibraryCache;
+
+	MemoryFile*					m_file;
+	const int*					m_entries;			// Order key, flags and file offset per entry
+	std::vector<const char*>	m_symbolNames;
+	std::vector<int>			m_symbolEntries;	// Entry defining each symbol, or -1
+	std::vector<bool>			m_claimedEntries;
+
+	std::unordered_map<PooledString, int, PooledString::Hash>	m_symbolIndex;		// Symbols not loaded yet
+
+	CachedLibrary(MemoryFile* file);
+
+	int					GetSymbolEntry(int symbol) const;	// Symbols past the symbol index denote entries
+
+	// Read and check the symbol index and entries. Returns false if the file is not a valid
+	// cache file for the library.
+	bool				Read(const char* build, const char* module, int size, unsigned long long hash);
+public:
+	~CachedLibrary();
+
+	virtual bool		ClaimSymbol(const PooledString& name, int& symbol);
+	virtual void		ClaimInitializers(std::vector<int>& symbols);
+	virtual HunkList*	LoadSymbol(int symbol, int* order) const;
+	virtual bool		FindUndecoratedSymbol(const char* name, PooledString& result) const;
+};
+
+#endif
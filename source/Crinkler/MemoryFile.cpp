@@ -1,10 +1,24 @@
 #include <cstdio>
+#include <climits>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "MemoryFile.h"
 
 #include "Log.h"
 
-MemoryFile::MemoryFile(const char* filename, bool abort_if_failed) {
+MemoryFile::MemoryFile(const char* filename, bool abort_if_failed, bool mapped) : m_mapped(false) {
+	if(mapped && Map(filename)) {
+		return;
+	}
+
 	FILE* file;
 	if(!fopen_s(&file, filename, "rb")) {
 		fseek(file, 0, SEEK_END);
@@ -27,7 +41,64 @@ MemoryFile::MemoryFile(const char* filename, bool abort_if_failed) {
 
 
 MemoryFile::~MemoryFile() {
-	delete[] m_data;
+	if(m_mapped) {
+#ifdef WIN32
+		UnmapViewOfFile(m_data);
+#else
+		munmap(m_data, m_size);
+#endif
+	} else {
+		delete[] m_data;
+	}
+}
+
+// The system fills the rest of the last page of a mapping with zeros. Files leaving fewer than
+// two bytes there are read instead, so that mapped files also end with two zero bytes.
+static bool HasZeroPadding(long long size, long long pageSize) {
+	long long tail = size % pageSize;
+	return tail != 0 && tail <= pageSize - 2;
+}
+
+// Map the file copy-on-write. Fails for empty files, which are read instead.
+bool MemoryFile::Map(const char* filename) {
+#ifdef WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+		return false;
+
+	SYSTEM_INFO system;
+	GetSystemInfo(&system);
+	LARGE_INTEGER size;
+	void* view = NULL;
+	if(GetFileSizeEx(file, &size) && size.QuadPart > 0 && size.QuadPart < INT_MAX && HasZeroPadding(size.QuadPart, system.dwPageSize)) {
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		if(mapping != NULL) {
+			// The view keeps the mapping open
+			view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+	if(view == NULL)
+		return false;
+	m_size = (int)size.QuadPart;
+#else
+	int file = open(filename, O_RDONLY);
+	if(file == -1)
+		return false;
+
+	struct stat info;
+	void* view = MAP_FAILED;
+	if(fstat(file, &info) == 0 && info.st_size > 0 && info.st_size < INT_MAX && HasZeroPadding(info.st_size, sysconf(_SC_PAGESIZE)))
+		view = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+	close(file);
+	if(view == MAP_FAILED)
+		return false;
+	m_size = (int)info.st_size;
+#endif
+	m_data = (char*)view;
+	m_mapped = true;
+	return true;
 }
 
 bool MemoryFile::Write(const char *filename) const {
@@ -4,8 +4,13 @@
 class MemoryFile {
 	char*	m_data;
 	int		m_size;
+	bool	m_mapped;
+
+	bool	Map(const char* filename);
 public:
-	MemoryFile(const char* filename, bool abort_if_failed = true);
+	// A mapped file is a copy-on-write view of the file, which is only read as it is accessed.
+	// Otherwise the file is read into memory. Either way the data is followed by two zero bytes.
+	MemoryFile(const char* filename, bool abort_if_failed = true, bool mapped = false);
 	~MemoryFile();
 
 	int		GetSize() const	{ return m_size; }
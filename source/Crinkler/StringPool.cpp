@@ -0,0 +1,89 @@
+#include "StringPool.h"
+
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+using namespace std;
+
+namespace {
+	// The pool is split into shards by hash, so threads loading files concurrently
+	// rarely wait for each other.
+	const int SHARD_BITS = 6;
+	const int NUM_SHARDS = 1 << SHARD_BITS;
+
+	// Characters of a string with their hash, computed once per lookup.
+	// Keys in the pool point into the pooled strings.
+	struct PoolKey {
+		const char*			str;
+		size_t				length;
+		unsigned long long	hash;
+
+		PoolKey(const char* str, size_t length) : str(str), length(length), hash(14695981039346656037ULL) {
+			// 64-bit FNV-1a
+			for(size_t i = 0; i < length; i++) {
+				hash ^= (unsigned char)str[i];
+				hash *= 1099511628211ULL;
+			}
+		}
+
+		// The shard is picked from the high bits, so the low bits still spread the keys of a shard
+		int	GetShard() const	{ return int(hash >> (64 - SHARD_BITS)); }
+	};
+	struct PoolKeyHash {
+		size_t operator()(const PoolKey& key) const				{ return (size_t)key.hash; }
+	};
+	struct PoolKeyEqual {
+		bool operator()(const PoolKey& a, const PoolKey& b) const	{ return a.length == b.length && memcmp(a.str, b.str, a.length) == 0; }
+	};
+
+	struct StringPoolShard {
+		mutex														lock;
+		unordered_map<PoolKey, const string*, PoolKeyHash, PoolKeyEqual>	strings;
+	};
+
+	// Never destroyed, so pooled strings stay valid during static destruction
+	StringPoolShard& GetShard(const PoolKey& key) {
+		static StringPoolShard* shards = new StringPoolShard[NUM_SHARDS];
+		return shards[key.GetShard()];
+	}
+
+	const string* Intern(const char* str, size_t length) {
+		PoolKey key(str, length);
+		StringPoolShard& shard = GetShard(key);
+		lock_guard<mutex> guard(shard.lock);
+		auto it = shard.strings.find(key);
+		if(it != shard.strings.end())
+			return it->second;
+
+		const string* pooled = new string(str, length);
+		key.str = pooled->data();
+		shard.strings.insert(make_pair(key, pooled));
+		return pooled;
+	}
+
+	const string* EmptyString() {
+		static const string* empty = Intern("", 0);
+		return empty;
+	}
+}
+
+PooledString::PooledString() : m_string(EmptyString()) {
+}
+
+PooledString::PooledString(const char* str) : m_string(*str ? Intern(str, strlen(str)) : EmptyString()) {
+}
+
+PooledString::PooledString(const string& str) : m_string(str.empty() ? EmptyString() : Intern(str.data(), str.size())) {
+}
+
+bool PooledString::Find(const char* str, PooledString& result) {
+	PoolKey key(str, strlen(str));
+	StringPoolShard& shard = GetShard(key);
+	lock_guard<mutex> guard(shard.lock);
+	auto it = shard.strings.find(key);
+	if(it == shard.strings.end())
+		return false;
+	result = PooledString(it->second);
+	return true;
+}
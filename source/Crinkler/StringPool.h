@@ -0,0 +1,51 @@
+#pragma once
+#ifndef _STRING_POOL_H_
+#define _STRING_POOL_H_
+
+#include <string>
+#include <cstddef>
+
+// Handle to a string in the linker-wide string pool. Equal strings share a single copy,
+// which lives until the process exits, so handles are cheap to copy, compare equal by
+// identity and can be hashed by address. Used for symbol, relocation and hunk names.
+class PooledString {
+	const std::string*	m_string;
+
+	explicit PooledString(const std::string* str) : m_string(str) {}
+public:
+	PooledString();
+	PooledString(const char* str);
+	PooledString(const std::string& str);
+
+	// Look up a string without adding it to the pool. Returns false if it is not pooled.
+	static bool Find(const char* str, PooledString& result);
+
+	const std::string&	str() const					{ return *m_string; }
+	const char*			c_str() const				{ return m_string->c_str(); }
+	size_t				size() const				{ return m_string->size(); }
+	bool				empty() const				{ return m_string->empty(); }
+	int					compare(const char* str) const	{ return m_string->compare(str); }
+	operator const std::string&() const				{ return *m_string; }
+
+	bool operator==(const PooledString& other) const	{ return m_string == other.m_string; }
+	bool operator!=(const PooledString& other) const	{ return m_string != other.m_string; }
+
+	// Hash by identity, for unordered containers
+	struct Hash {
+		size_t operator()(const PooledString& str) const	{ return std::hash<const std::string*>()(str.m_string); }
+	};
+
+	// Order by content, for ordered containers. Allows lookup by C string.
+	struct Less {
+		typedef void is_transparent;
+		bool operator()(const PooledString& a, const PooledString& b) const	{ return a.m_string != b.m_string && *a.m_string < *b.m_string; }
+		bool operator()(const PooledString& a, const char* b) const			{ return a.m_string->compare(b) < 0; }
+		bool operator()(const char* a, const PooledString& b) const			{ return b.m_string->compare(a) > 0; }
+	};
+};
+
+inline bool operator<(const PooledString& a, const PooledString& b) {
+	return PooledString::Less()(a, b);
+}
+
+#endif
@@ -5,7 +5,7 @@
 #include "Symbol.h"
 #include "Crinkler.h"
 
-bool Transform::LinkAndTransform(HunkList* hunklist, Symbol *entry_label, int baseAddress, Hunk* &transformedHunk, Hunk** untransformedHunk, int* splittingPoint, bool verbose)
+Hunk* Transform::CreateDetransformer()
 {
 	Hunk* detrans = nullptr;
 	if (m_enabled)
@@ -21,6 +21,12 @@ bool Transform::LinkAndTransform(HunkList* hunklist, Symbol *entry_label, int ba
 	{
 		detrans = new Hunk("Stub", NULL, HUNK_IS_CODE, 0, 0, 0);
 	}
+	return detrans;
+}
+
+bool Transform::LinkAndTransform(HunkList* hunklist, Symbol *entry_label, int baseAddress, Hunk* &transformedHunk, Hunk** untransformedHunk, int* splittingPoint, bool verbose)
+{
+	Hunk* detrans = CreateDetransformer();
 	hunklist->AddHunkFront(detrans);
 	detrans->SetContinuation(entry_label);
 
@@ -12,19 +12,26 @@ public:
 	virtual ~Transform() {};
 
 	virtual Hunk*	GetDetransformer() = 0;
-	virtual bool	DoTransform(Hunk* hunk, int splittingPoint, bool verbose) = 0;
+
+	// Transforms a linked hunk. Returns false if the transform does not apply, in which case the
+	// caller should disable the transform and link again. Can be called concurrently.
+	virtual bool	DoTransform(Hunk* hunk, int splittingPoint, bool verbose) const = 0;
+
+	// Returns the detransformer to put in front of the linked hunks, or an empty stub if disabled
+	Hunk*			CreateDetransformer();
 
 	// Links and transforms a hunklist. Provides both a transformed and non-transformed linked version.
-	// Returns true if the transform succeeds
+	// Returns true if the transform succeeds. Does not change the transform.
 	bool			LinkAndTransform(HunkList* hunklist, Symbol *entry_label, int baseAddress, Hunk* &transformedHunk, Hunk** untransformedHunk, int* splittingPoint, bool verbose);
 
 	void			Disable() { m_enabled = false; }
+	bool			IsEnabled() const { return m_enabled; }
 };
 
 class IdentityTransform : public Transform {
 public:
 	Hunk*	GetDetransformer() { return nullptr; }
-	bool	DoTransform(Hunk* hunk, int splittingPoint, bool verbose) { return true; }
+	bool	DoTransform(Hunk* hunk, int splittingPoint, bool verbose) const { return true; }
 };
 
 #endif
@@ -117,7 +117,8 @@ const char *LoadDLL(const char *name) {
 		return NULL;
 	}
 
-	MemoryFile* mf = new MemoryFile(filepaths[0].c_str());
+	// Only the pages that are read are loaded
+	MemoryFile* mf = new MemoryFile(filepaths[0].c_str(), true, true);
 	dllFileMap[strName] = mf;
 	return mf->GetPtr();
 }
@@ -211,8 +212,12 @@ int main(int argc, char* argv[]) {
 							1, 1000, 500);
 	CmdParamInt hashtriesArg("HASHTRIES", "number of hashing tries", "number of hashing tries", 0,
 							0, 100000, 100);
+	CmdParamInt hashShortlistArg("HASHSHORTLIST", "number of hash sizes with fewest predicted collisions to try", "number of hash sizes", 0,
+							0, 100000, 0);
 	CmdParamInt hunktriesArg("ORDERTRIES", "", "number of section reordering tries", 0,
 							0, 100000, 0);
+	CmdParamFlags hunksearchArg("ORDERSEARCH", "section reordering search strategy", PARAM_FORBID_MULTIPLE_DEFINITIONS, HUNK_SEARCH_HILLCLIMB,
+						"HILLCLIMB", HUNK_SEARCH_HILLCLIMB, "ANNEAL", HUNK_SEARCH_ANNEAL, "TABU", HUNK_SEARCH_TABU, NULL);
 	CmdParamInt truncateFloatsArg("TRUNCATEFLOATS", "truncates floats", "bits", PARAM_ALLOW_NO_ARGUMENT_DEFAULT,
 							0, 64, 64);
 	CmdParamInt overrideAlignmentsArg("OVERRIDEALIGNMENTS", "override section alignments using align labels", "bits",  PARAM_ALLOW_NO_ARGUMENT_DEFAULT,
@@ -255,6 +260,8 @@ int main(int argc, char* argv[]) {
 							NULL);
 	CmdParamFlags saturateArg("SATURATE", "saturate counters (for highly repetitive data)", PARAM_ALLOW_NO_ARGUMENT_DEFAULT | PARAM_FORBID_MULTIPLE_DEFINITIONS, 1, "NO", 0, NULL);
 	CmdParamString libpathArg("LIBPATH", "adds a path to the library search path", "dirs", PARAM_IS_SWITCH, 0);
+	CmdParamString libcacheArg("LIBCACHE", "cache parsed libraries in this directory", "dir",
+						PARAM_IS_SWITCH|PARAM_FORBID_MULTIPLE_DEFINITIONS, "");
 	CmdParamString rangeImportArg("RANGE", "use range importing for this dll", "dllname", PARAM_IS_SWITCH, 0);
 	CmdParamMultiAssign replaceDllArg("REPLACEDLL", "replace a dll with another", "oldDLL=newDLL", PARAM_IS_SWITCH);
 	CmdParamMultiAssign fallbackDllArg("FALLBACKDLL", "try opening another dll if the first one fails", "firstDLL=otherDLL", PARAM_IS_SWITCH);
@@ -264,8 +271,8 @@ int main(int argc, char* argv[]) {
 	CmdParamString filesArg("FILES", "list of filenames", "", PARAM_HIDE_IN_PARAM_LIST, 0);
 	CmdLineInterface cmdline(CRINKLER_TITLE, CMDI_PARSE_FILES);
 
-	cmdline.AddParams(&crinklerFlag, &hashsizeArg, &hashtriesArg, &hunktriesArg, &noDefaultLibArg, &entryArg, &outArg, &summaryArg, &reuseFileArg, &reuseArg, &unsafeImportArg,
-						&subsystemArg, &largeAddressAwareArg, &truncateFloatsArg, &overrideAlignmentsArg, &unalignCodeArg, &compmodeArg, &saturateArg, &printArg, &transformArg, &libpathArg, 
+	cmdline.AddParams(&crinklerFlag, &hashsizeArg, &hashtriesArg, &hashShortlistArg, &hunktriesArg, &hunksearchArg, &noDefaultLibArg, &entryArg, &outArg, &summaryArg, &reuseFileArg, &reuseArg, &unsafeImportArg,
+						&subsystemArg, &largeAddressAwareArg, &truncateFloatsArg, &overrideAlignmentsArg, &unalignCodeArg, &compmodeArg, &saturateArg, &printArg, &transformArg, &libpathArg, &libcacheArg,
 						&rangeImportArg, &replaceDllArg, &fallbackDllArg, &exportArg, &stripExportsArg, &noInitializersArg, &filesArg, &priorityArg, &showProgressArg, &recompressFlag,
 						&tinyHeader, &tinyImport,
 						NULL);
@@ -299,7 +306,7 @@ int main(int argc, char* argv[]) {
 		subsystemArg.SetDefault(-1);
 		compmodeArg.SetDefault(-1);
 
-		cmdline2.AddParams(&crinklerFlag, &recompressFlag, &outArg, &hashsizeArg, &hashtriesArg, &subsystemArg, &largeAddressAwareArg, &compmodeArg, &saturateArg, &replaceDllArg, &summaryArg, &exportArg, &stripExportsArg, &priorityArg, &showProgressArg, &filesArg, NULL);
+		cmdline2.AddParams(&crinklerFlag, &recompressFlag, &outArg, &hashsizeArg, &hashtriesArg, &hashShortlistArg, &subsystemArg, &largeAddressAwareArg, &compmodeArg, &saturateArg, &replaceDllArg, &summaryArg, &exportArg, &stripExportsArg, &priorityArg, &showProgressArg, &filesArg, NULL);
 		cmdline2.SetCmdParameters(argc, argv);
 		if(cmdline2.Parse()) {
 			crinkler.SetHashsize(hashsizeArg.GetValue());
@@ -308,6 +315,7 @@ int main(int argc, char* argv[]) {
 			crinkler.SetCompressionType((CompressionType)compmodeArg.GetValue());
 			crinkler.SetSaturate(saturateArg.GetValueIfPresent(-1));
 			crinkler.SetHashtries(hashtriesArg.GetValue());
+			crinkler.SetHashShortlist(hashShortlistArg.GetValue());
 			crinkler.ShowProgressBar(showProgressArg.GetValue());
 			crinkler.SetSummary(summaryArg.GetValue());
 			ParseExports(exportArg, crinkler);
@@ -356,6 +364,8 @@ int main(int argc, char* argv[]) {
 			} else {
 				printf("Hash size: %d MB\n", hashsizeArg.GetValue());
 				printf("Hash tries: %d\n", hashtriesArg.GetValue());
+				if (hashShortlistArg.GetValue() > 0)
+					printf("Hash shortlist: %d\n", hashShortlistArg.GetValue());
 			}
 			printf("Report: %s\n", strlen(summaryArg.GetValue()) > 0 ? summaryArg.GetValue() : "NONE");
 
@@ -431,7 +441,9 @@ int main(int argc, char* argv[]) {
 	crinkler.SetLargeAddressAware(largeAddressAwareArg.GetValueIfPresent(0));
 	crinkler.SetCompressionType((CompressionType)compmodeArg.GetValue());
 	crinkler.SetHashtries(hashtriesArg.GetValue());
+	crinkler.SetHashShortlist(hashShortlistArg.GetValue());
 	crinkler.SetHunktries(hunktriesArg.GetValue());
+	crinkler.SetHunkSearch((HunkSearchType)hunksearchArg.GetValue());
 	crinkler.SetSaturate(saturateArg.GetValueIfPresent(0));
 	crinkler.SetPrintFlags(printArg.GetValue());
 	crinkler.ShowProgressBar(showProgressArg.GetValue());
@@ -442,6 +454,7 @@ int main(int argc, char* argv[]) {
 	crinkler.SetAlignmentBits(overrideAlignmentsArg.GetValue());
 	crinkler.SetRunInitializers(!noInitializersArg.GetValue());
 	crinkler.SetSummary(summaryArg.GetValue());
+	crinkler.SetLibraryCache(libcacheArg.GetValue());
 	if (reuseFileArg.GetNumMatches() > 0) {
 		crinkler.SetReuse((ReuseType)reuseArg.GetValue(), reuseFileArg.GetValue());
 	}
@@ -467,6 +480,8 @@ int main(int argc, char* argv[]) {
 	printf("Saturate counters: %s\n", saturateArg.GetValueIfPresent(0) ? "YES" : "NO");
 	printf("Hash size: %d MB\n", hashsizeArg.GetValue());
 	printf("Hash tries: %d\n", hashtriesArg.GetValue());
+	if (hashShortlistArg.GetValue() > 0)
+		printf("Hash shortlist: %d\n", hashShortlistArg.GetValue());
 	printf("Order tries: %d\n", hunktriesArg.GetValue());
 	if (reuseFileArg.GetNumMatches() > 0) {
 		printf("Reuse mode: %s\n", ReuseTypeName((ReuseType)reuseArg.GetValue()));
@@ -476,6 +491,7 @@ int main(int argc, char* argv[]) {
 		printf("Reuse mode: OFF (no file specified)\n");
 	}
 	printf("Report: %s\n", strlen(summaryArg.GetValue()) > 0 ? summaryArg.GetValue() : "NONE");
+	printf("Library cache: %s\n", strlen(libcacheArg.GetValue()) > 0 ? libcacheArg.GetValue() : "NONE");
 	printf("Transforms: %s\n", (transformArg.GetValue() & TRANSFORM_CALLS) ? "CALLS" : "NONE");
 
 	// Replace DLL
@@ -562,6 +578,7 @@ int main(int argc, char* argv[]) {
 	
 	// Load files
 	{
+		vector<string> filepaths;
 		while(filesArg.HasNext()) {
 			const char* filename = filesArg.GetValue();
 			filesArg.Next();
@@ -572,10 +589,10 @@ int main(int argc, char* argv[]) {
 			} else {
 				printf("Loading %s...\n", filename);
 				fflush(stdout);
-				string filepath = *res.begin();
-				crinkler.Load(filepath.c_str());
+				filepaths.push_back(*res.begin());
 			}
 		}
+		crinkler.Load(filepaths);
 		if (!noDefaultLibArg.GetValue()) {
 			crinkler.AddRuntimeLibrary();
 		}